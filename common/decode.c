@@ -0,0 +1,146 @@
+#include "gcode.h"
+
+/* Appends an instruction, returning its index. */
+static size_t emit(gcprogram *prog, unsigned char op, unsigned short code,
+                   unsigned operand) {
+  gcinsn *insn = &prog->insns[prog->insncnt];
+  insn->op = op;
+  insn->axes = 0;
+  insn->code = code;
+  insn->operand = operand;
+  return prog->insncnt++;
+}
+
+void gc_decode_block(gcprogram *prog) {
+  const size_t b = prog->blockcnt - 1;
+  float values[5];              /* Indexed by axis bit */
+  unsigned axes = 0;
+  size_t target = (size_t)-1;   /* Instruction taking the axis words */
+  size_t w;
+  for(w = prog->wordidx[b]; w < prog->wordidx[b + 1]; ++w) {
+    const char letter = prog->letters[w];
+    const float num = prog->nums[w];
+    const int code = (int)num;
+    switch(letter) {
+    case 'G':
+      switch(code) {
+      case 0:
+        target = emit(prog, GCOP_RAPID, code, 0);
+        break;
+      case 1:
+        target = emit(prog, GCOP_LINEAR, code, 0);
+        break;
+      case 4:
+        emit(prog, GCOP_DWELL, code, 0);
+        break;
+      case 20:
+        emit(prog, GCOP_INCHES, code, 0);
+        break;
+      case 21:
+        emit(prog, GCOP_MM, code, 0);
+        break;
+      case 28:
+        target = emit(prog, GCOP_HOME, code, 0);
+        break;
+      case 90:
+        emit(prog, GCOP_SET_ABS, code, 0);
+        break;
+      case 91:
+        emit(prog, GCOP_SET_REL, code, 0);
+        break;
+      case 92:
+        target = emit(prog, GCOP_SET_POS, code, 0);
+        break;
+
+      default:                  /* Including arcs (G2, G3) */
+        emit(prog, GCOP_UNSUPPORTED, letter, w);
+        break;
+      }
+      break;
+
+    case 'M':
+      switch(code) {
+      case 101:
+        emit(prog, GCOP_EXTRUDER_ON, code, 0);
+        break;
+      case 102:
+        emit(prog, GCOP_EXTRUDER_OFF, code, 0);
+        break;
+      case 103:
+        emit(prog, GCOP_EXTRUDER_REVERSE, code, 0);
+        break;
+      case 82:
+        emit(prog, GCOP_E_ABS, code, 0);
+        break;
+      case 83:
+        emit(prog, GCOP_E_REL, code, 0);
+        break;
+
+        /* Ignored */
+      case 1:                   /* Interactive extruder test */
+      case 6:                   /* Wait for warmup */
+      case 104:                 /* Set temp (slow) */
+      case 105:                 /* Get temp */
+      case 106:                 /* Fan on */
+      case 107:                 /* Fan off */
+      case 108:                 /* Set speed */
+      case 109:                 /* Set temp (slow) */
+      case 113:                 /* Extruder PWM */
+        break;
+
+      default:
+        emit(prog, GCOP_UNSUPPORTED, letter, w);
+        break;
+      }
+      break;
+
+    case 'X':
+      axes |= GCAXIS_X;
+      values[0] = num;
+      break;
+    case 'Y':
+      axes |= GCAXIS_Y;
+      values[1] = num;
+      break;
+    case 'Z':
+      axes |= GCAXIS_Z;
+      values[2] = num;
+      break;
+    case 'E':                   /* Extrude length */
+      axes |= GCAXIS_E;
+      values[3] = num;
+      break;
+    case 'F':                   /* Feedrate */
+      axes |= GCAXIS_F;
+      values[4] = num;
+      break;
+
+      /* Ignored words */
+    case 'P':                   /* Param to Dwell, others? */
+    case 'S':                   /* Speed */
+    case 'R':                   /* Param to M108 meaning what? */
+    case 'T':                   /* Param to M6 (wait for warmup), others? */
+      break;
+
+    default:
+      emit(prog, GCOP_UNSUPPORTED, letter, w);
+      break;
+    }
+  }
+
+  if(axes) {
+    if(target == (size_t)-1) {
+      target = emit(prog, GCOP_AXES, 0, 0);
+    }
+    gcinsn *insn = &prog->insns[target];
+    insn->axes = axes;
+    insn->operand = prog->opercnt;
+    unsigned i;
+    for(i = 0; i < 5; ++i) {
+      if(axes & (1 << i)) {
+        prog->operands[prog->opercnt++] = values[i];
+      }
+    }
+  }
+  prog->insnidx[b + 1] = prog->insncnt;
+}
@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "decompress.h"
+
+/* Size of the buffers on either side of the decompressor */
+#define CHUNK 65536
+
+enum {
+  PLAIN,
+  GZIP,
+  ZSTD
+};
+
+static const unsigned char gzip_magic[] = {0x1f, 0x8b};
+static const unsigned char zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+/* Returns nonzero if buf could still turn out to start with magic. */
+static int could_be(const unsigned char *buf, size_t len,
+                    const unsigned char *magic, size_t magiclen) {
+  return memcmp(buf, magic, len < magiclen ? len : magiclen) == 0;
+}
+
+/* Returns the format of data starting with buf, or -1 if more of it is
+ * needed to tell. */
+static int detect(const unsigned char *buf, size_t len) {
+  int undecided = 0;
+  if(could_be(buf, len, gzip_magic, sizeof(gzip_magic))) {
+    if(len >= sizeof(gzip_magic)) {
+      return GZIP;
+    }
+    undecided = 1;
+  }
+  if(could_be(buf, len, zstd_magic, sizeof(zstd_magic))) {
+    if(len >= sizeof(zstd_magic)) {
+      return ZSTD;
+    }
+    undecided = 1;
+  }
+  return undecided ? -1 : PLAIN;
+}
+
+typedef struct job {
+  int in, out;
+  int fd;                       /* The pipe's read end, returned for in */
+  int format;
+  unsigned char start[GCDECOMPRESS_PEEK]; /* Already read from in */
+  size_t startlen;
+  int error;                    /* errno the thread stopped with, or 0 */
+  pthread_t thread;
+  struct job *next;
+} job;
+
+/* Running jobs, by the pipe's read end, for gcdecompress_close */
+static job *jobs = NULL;
+static pthread_mutex_t jobslock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Reads compressed data, starting with whatever was read to detect it.
+ * Returns 0 at EOF. */
+static ssize_t input(job *j, unsigned char *buf, size_t size) {
+  if(j->startlen) {
+    const size_t len = j->startlen;
+    memcpy(buf, j->start, len);
+    j->startlen = 0;
+    return len;
+  }
+  while(1) {
+    const ssize_t got = read(j->in, buf, size);
+    if(got >= 0) {
+      return got;
+    }
+    if(errno == EAGAIN || errno == EWOULDBLOCK) {
+      /* Whoever opened in may have made it non-blocking */
+      struct pollfd p = {j->in, POLLIN, 0};
+      poll(&p, 1, -1);
+    } else if(errno != EINTR) {
+      j->error = errno;
+      perror("Reading compressed input failed");
+      return -1;
+    }
+  }
+}
+
+/* Writes all of buf to the pipe.  Returns -1 if the reader has gone
+ * away. */
+static int output(job *j, const unsigned char *buf, size_t len) {
+  while(len) {
+    const ssize_t wrote = write(j->out, buf, len);
+    if(wrote < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      if(errno != EPIPE) {
+        perror("Writing decompressed input failed");
+      }
+      return -1;
+    }
+    buf += wrote;
+    len -= wrote;
+  }
+  return 0;
+}
+
+#ifdef HAVE_ZLIB
+static void gunzip(job *j, unsigned char *in, unsigned char *out) {
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  /* 32 accepts a zlib header as well as gzip's */
+  if(inflateInit2(&z, 15 + 32) != Z_OK) {
+    fprintf(stderr, "Failed to initialize zlib\n");
+    j->error = ENOMEM;
+    return;
+  }
+  int result = Z_OK;
+  z.avail_out = CHUNK;
+  while(1) {
+    if(z.avail_in == 0 && z.avail_out != 0) {
+      const ssize_t got = input(j, in, CHUNK);
+      if(got <= 0) {
+        if(got == 0 && result != Z_STREAM_END) {
+          fprintf(stderr, "Compressed input is truncated\n");
+          j->error = EIO;
+        }
+        break;
+      }
+      z.next_in = in;
+      z.avail_in = got;
+    }
+    if(result == Z_STREAM_END && z.avail_in) {
+      /* Concatenated gzip files are just one longer file */
+      inflateReset(&z);
+    }
+    z.next_out = out;
+    z.avail_out = CHUNK;
+    result = inflate(&z, Z_NO_FLUSH);
+    if(result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+      fprintf(stderr, "Decompressing input failed: %s\n",
+              z.msg ? z.msg : "zlib error");
+      j->error = (result == Z_MEM_ERROR) ? ENOMEM : EIO;
+      break;
+    }
+    if(output(j, out, CHUNK - z.avail_out) < 0) {
+      break;
+    }
+  }
+  inflateEnd(&z);
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static void unzstd(job *j, unsigned char *in, unsigned char *out) {
+  ZSTD_DStream *d = ZSTD_createDStream();
+  if(!d) {
+    fprintf(stderr, "Failed to initialize zstd\n");
+    j->error = ENOMEM;
+    return;
+  }
+  ZSTD_initDStream(d);
+  ZSTD_inBuffer src = {in, 0, 0};
+  ZSTD_outBuffer dst = {out, CHUNK, 0};
+  size_t result = 0;
+  while(1) {
+    if(src.pos == src.size && dst.pos < dst.size) {
+      const ssize_t got = input(j, in, CHUNK);
+      if(got <= 0) {
+        if(got == 0 && result != 0) {
+          fprintf(stderr, "Compressed input is truncated\n");
+          j->error = EIO;
+        }
+        break;
+      }
+      src.size = got;
+      src.pos = 0;
+    }
+    dst.pos = 0;
+    /* Frames following the first are decoded as they come */
+    result = ZSTD_decompressStream(d, &dst, &src);
+    if(ZSTD_isError(result)) {
+      fprintf(stderr, "Decompressing input failed: %s\n",
+              ZSTD_getErrorName(result));
+      j->error = EIO;
+      break;
+    }
+    if(output(j, out, dst.pos) < 0) {
+      break;
+    }
+  }
+  ZSTD_freeDStream(d);
+}
+#endif
+
+static void *decompress(void *arg) {
+  job *j = arg;
+  unsigned char *in = malloc(CHUNK), *out = malloc(CHUNK);
+  if(in && out) {
+    switch(j->format) {
+#ifdef HAVE_ZLIB
+    case GZIP:
+      gunzip(j, in, out);
+      break;
+#endif
+#ifdef HAVE_ZSTD
+    case ZSTD:
+      unzstd(j, in, out);
+      break;
+#endif
+    default:
+      break;
+    }
+  } else {
+    j->error = ENOMEM;
+  }
+  /* The reader sees EOF however we stopped, and learns how from
+   * gcdecompress_close */
+  close(j->out);
+  close(j->in);
+  free(in);
+  free(out);
+  return NULL;
+}
+
+static int supported(int format) {
+  switch(format) {
+#ifdef HAVE_ZLIB
+  case GZIP:
+    return 1;
+#endif
+#ifdef HAVE_ZSTD
+  case ZSTD:
+    return 1;
+#endif
+  default:
+    return 0;
+  }
+}
+
+int gcdecompress_open(int fd, char *peek, size_t *peeklen) {
+  unsigned char buf[GCDECOMPRESS_PEEK];
+  size_t len = 0;
+  int format = -1;
+  *peeklen = 0;
+
+  struct stat st;
+  if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    const off_t at = lseek(fd, 0, SEEK_CUR);
+    const ssize_t got = pread(fd, buf, sizeof(buf), at < 0 ? 0 : at);
+    if(got < 0) {
+      return -1;
+    }
+    format = detect(buf, got);
+  } else {
+    /* Read no further than it takes to decide, so that e.g. a line
+     * typed at a terminal isn't waited on */
+    do {
+      const ssize_t got = read(fd, buf + len, sizeof(buf) - len);
+      if(got < 0) {
+        if(errno == EINTR) {
+          continue;
+        }
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+          struct pollfd p = {fd, POLLIN, 0};
+          poll(&p, 1, -1);
+          continue;
+        }
+        return -1;
+      }
+      if(got == 0) {
+        break;
+      }
+      len += got;
+    } while((format = detect(buf, len)) < 0);
+  }
+  if(format < 0) {
+    /* Too short to be anything but gcode */
+    format = PLAIN;
+  }
+
+  if(format == PLAIN) {
+    memcpy(peek, buf, len);
+    *peeklen = len;
+    return fd;
+  }
+  if(!supported(format)) {
+    errno = ENOTSUP;
+    return -1;
+  }
+
+  int fds[2];
+  if(pipe(fds) < 0) {
+    return -1;
+  }
+  job *j = malloc(sizeof(job));
+  if(!j) {
+    close(fds[0]);
+    close(fds[1]);
+    errno = ENOMEM;
+    return -1;
+  }
+  j->in = fd;
+  j->out = fds[1];
+  j->format = format;
+  memcpy(j->start, buf, len);
+  j->startlen = len;
+  j->error = 0;
+
+  /* Signals are the main thread's to handle, and a reader closing the
+   * pipe early should only make write fail with EPIPE */
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  const int result = pthread_create(&j->thread, NULL, decompress, j);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if(result != 0) {
+    close(fds[0]);
+    close(fds[1]);
+    free(j);
+    errno = result;
+    return -1;
+  }
+  j->fd = fds[0];
+  pthread_mutex_lock(&jobslock);
+  j->next = jobs;
+  jobs = j;
+  pthread_mutex_unlock(&jobslock);
+  return fds[0];
+}
+
+int gcdecompress_close(int fd) {
+  pthread_mutex_lock(&jobslock);
+  job **at = &jobs;
+  while(*at && (*at)->fd != fd) {
+    at = &(*at)->next;
+  }
+  job *j = *at;
+  if(j) {
+    *at = j->next;
+  }
+  pthread_mutex_unlock(&jobslock);
+
+  /* Closing first stops a thread still writing, with EPIPE */
+  close(fd);
+  if(!j) {
+    return 0;
+  }
+  pthread_join(j->thread, NULL);
+  const int error = j->error;
+  free(j);
+  if(error) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+int gcdecompress_suffix(const char *name, size_t *len) {
+  static const char *const suffixes[] = {".gz", ".zst"};
+  size_t i;
+  for(i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); ++i) {
+    const size_t n = strlen(suffixes[i]);
+    if(*len > n && strncmp(name + *len - n, suffixes[i], n) == 0) {
+      *len -= n;
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef _DECOMPRESS_H_
+#define _DECOMPRESS_H_
+
+#include <stddef.h>
+
+/* Most bytes gcdecompress_open may have to read to tell what fd holds */
+#define GCDECOMPRESS_PEEK 4
+
+/* Lets gcode be read straight out of a gzip file or, if built with
+ * libzstd, a zstd file.  If fd holds compressed data, a thread is started
+ * to decompress it into a pipe, and the pipe's read end is returned in
+ * place of fd; the thread owns fd from then on and closes it when done.
+ * Otherwise fd itself is returned.  Either way, the result should be
+ * closed with gcdecompress_close, which says whether all of it came
+ * through.
+ *
+ * A regular file is checked without moving its offset, so an
+ * uncompressed one can still be mapped.  Anything else has to be read to
+ * be checked: the bytes read are stored in peek, at most
+ * GCDECOMPRESS_PEEK of them, and their count in *peeklen, and must be
+ * treated as coming before whatever is read from the returned
+ * descriptor.
+ *
+ * Returns -1 with errno set if fd can't be read, if it's compressed in a
+ * format this build doesn't support (ENOTSUP), or if the thread can't be
+ * started. */
+int gcdecompress_open(int fd, char *peek, size_t *peeklen);
+
+/* Closes fd, as returned by gcdecompress_open, first waiting for any
+ * thread decompressing into it.  Returns 0, or -1 with errno set if
+ * decompression failed, e.g. on corrupt or truncated input (EIO), so
+ * that the EOF read before was premature. */
+int gcdecompress_close(int fd);
+
+/* Strips a compressed file's suffix, e.g. .gz, by shortening *len.
+ * Returns nonzero if there was one. */
+int gcdecompress_suffix(const char *name, size_t *len);
+
+#endif
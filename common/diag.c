@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "diag.h"
+
+void gcdiag_init(gcdiag *diag) {
+  diag->kinds = NULL;
+  diag->kindcnt = diag->kindcap = 0;
+  diag->quotelen = 0;
+  diag->quotecut = 0;
+}
+
+void gcdiag_free(gcdiag *diag) {
+  free(diag->kinds);
+  gcdiag_init(diag);
+}
+
+void gcdiag_reset(gcdiag *diag) {
+  diag->kindcnt = 0;
+  diag->quotelen = 0;
+  diag->quotecut = 0;
+}
+
+/* Counts a problem, unless it has already been counted for this line. */
+static void record(gcdiag *diag, unsigned real_line, char letter, int code) {
+  /* There are only ever a handful of kinds, and the last one is
+   * usually met again */
+  size_t i = diag->kindcnt;
+  while(i--) {
+    gcdiag_kind *kind = &diag->kinds[i];
+    if(kind->letter == letter && kind->code == code) {
+      if(kind->last_line != real_line) {
+        ++kind->count;
+        kind->last_line = real_line;
+      }
+      return;
+    }
+  }
+
+  if(diag->kindcnt == diag->kindcap) {
+    const size_t cap = diag->kindcap ? 2 * diag->kindcap : 16;
+    gcdiag_kind *kinds = realloc(diag->kinds, cap * sizeof(gcdiag_kind));
+    if(!kinds) {
+      return;
+    }
+    diag->kinds = kinds;
+    diag->kindcap = cap;
+  }
+  gcdiag_kind *kind = &diag->kinds[diag->kindcnt++];
+  kind->letter = letter;
+  kind->code = code;
+  kind->count = 1;
+  kind->first_line = kind->last_line = real_line;
+}
+
+void gcdiag_malformed(gcdiag *diag, unsigned real_line, const char *text,
+                      size_t len) {
+  if(diag->quotelen == 0 && len) {
+    diag->quotelen = len < GCDIAG_QUOTE ? len : GCDIAG_QUOTE;
+    memcpy(diag->quote, text, diag->quotelen);
+    diag->quotecut = len > GCDIAG_QUOTE;
+  }
+  record(diag, real_line, 0, -1);
+}
+
+void gcdiag_unsupported(gcdiag *diag, unsigned real_line, char letter,
+                        float num) {
+  const int code = (letter == 'G' || letter == 'M') ? (int)num : -1;
+  record(diag, real_line, letter, code);
+}
+
+unsigned gcdiag_count(const gcdiag *diag) {
+  unsigned total = 0;
+  size_t i;
+  for(i = 0; i < diag->kindcnt; ++i) {
+    total += diag->kinds[i].count;
+  }
+  return total;
+}
+
+void gcdiag_report(const gcdiag *diag, FILE *out) {
+  size_t i;
+  for(i = 0; i < diag->kindcnt; ++i) {
+    const gcdiag_kind *kind = &diag->kinds[i];
+    const char *s = kind->count == 1 ? "" : "s";
+    fprintf(out, "WARNING: ");
+    if(kind->letter == 0) {
+      fprintf(out, "Skipped %u malformed block%s, first on line %u: \"%.*s%s\"\n",
+              kind->count, s, kind->first_line, (int)diag->quotelen,
+              diag->quote, diag->quotecut ? "..." : "");
+    } else if(kind->code >= 0) {
+      fprintf(out, "Skipped unsupported %c code %c%d in %u block%s, first on line %u\n",
+              kind->letter, kind->letter, kind->code, kind->count, s,
+              kind->first_line);
+    } else {
+      fprintf(out, "Skipped unrecognized word %c in %u block%s, first on line %u\n",
+              kind->letter, kind->count, s, kind->first_line);
+    }
+  }
+}
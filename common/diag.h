@@ -0,0 +1,50 @@
+#ifndef _DIAG_H_
+#define _DIAG_H_
+
+#include <stdio.h>
+
+/* Longest malformed block kept to quote in a report */
+#define GCDIAG_QUOTE 64
+
+/* One kind of problem: an unsupported G or M code, an unrecognized
+ * word, or a malformed block (letter 0). */
+typedef struct gcdiag_kind {
+  char letter;
+  int code;                     /* G/M number, or -1 */
+  unsigned count;               /* Blocks with the problem */
+  unsigned first_line, last_line;
+} gcdiag_kind;
+
+/* Tallies the problems met while parsing, to be reported once as a
+ * summary rather than a warning per word as they happen.  Each problem
+ * is counted at most once per block. */
+typedef struct gcdiag {
+  gcdiag_kind *kinds;           /* In order of first appearance */
+  size_t kindcnt, kindcap;
+  char quote[GCDIAG_QUOTE];     /* The first malformed block */
+  size_t quotelen;
+  char quotecut;                /* Set if the block was longer */
+} gcdiag;
+
+void gcdiag_init(gcdiag *diag);
+
+void gcdiag_free(gcdiag *diag);
+
+/* Forgets everything recorded. */
+void gcdiag_reset(gcdiag *diag);
+
+void gcdiag_malformed(gcdiag *diag, unsigned real_line, const char *text,
+                      size_t len);
+
+/* letter is the word's letter and num its value, as for
+ * gcparse.unsupported. */
+void gcdiag_unsupported(gcdiag *diag, unsigned real_line, char letter,
+                        float num);
+
+/* Total problems recorded. */
+unsigned gcdiag_count(const gcdiag *diag);
+
+/* Writes one warning line per kind of problem to out. */
+void gcdiag_report(const gcdiag *diag, FILE *out);
+
+#endif
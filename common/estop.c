@@ -0,0 +1,107 @@
+#include "estop.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+
+uint64_t gcestop_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Milliseconds left before deadline, rounded up so as not to spin */
+static int remaining(uint64_t deadline) {
+  const uint64_t now = gcestop_now();
+  return now >= deadline ? 0 : (int)((deadline - now + 999999) / 1000000);
+}
+
+/* Bytes the port has yet to send, or 0 if it can't say */
+static int unsent(int fd) {
+#ifdef TIOCOUTQ
+  int n;
+  if(ioctl(fd, TIOCOUTQ, &n) == 0) {
+    return n;
+  }
+#endif
+  return 0;
+}
+
+int gcestop_send(int fd, int timeout, gcestop_times *times) {
+  gcestop_times t = {gcestop_now(), 0, 0};
+  const uint64_t deadline = t.start + (uint64_t)timeout * 1000000;
+  const char *halt = GCESTOP_HALT;
+  size_t left = strlen(halt);
+  int result = 1;
+
+  /* The device is likely non-blocking, and its buffer may be full of
+   * lines already sent */
+  while(left) {
+    const ssize_t n = write(fd, halt, left);
+    if(n > 0) {
+      halt += n;
+      left -= n;
+      continue;
+    }
+    if(n < 0 && errno == EINTR) {
+      continue;
+    }
+    if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      result = -1;
+      break;
+    }
+    const int ms = remaining(deadline);
+    if(!ms) {
+      break;
+    }
+    struct pollfd p = {fd, POLLOUT, 0};
+    poll(&p, 1, ms);
+  }
+
+  if(!left) {
+    t.written = gcestop_now();
+    /* tcdrain could block for good on a wedged port, so watch the
+     * output queue empty instead */
+    while(1) {
+      if(!unsent(fd)) {
+        t.drained = gcestop_now();
+        result = 0;
+        break;
+      }
+      if(!remaining(deadline)) {
+        break;
+      }
+      const struct timespec tick = {0, 100000};
+      nanosleep(&tick, NULL);
+    }
+  }
+
+  if(times) {
+    *times = t;
+  }
+  return result;
+}
+
+void gcestop_report(const gcestop_times *times, uint64_t since, int result,
+                    const char *why) {
+  if(result < 0) {
+    fprintf(stderr, "Emergency stop (%s) could not be sent: %s\n",
+            why, strerror(errno));
+  } else if(!times->written) {
+    fprintf(stderr, "Emergency stop (%s) could not be written within %.3f ms!\n",
+            why, (gcestop_now() - since) / 1e6);
+  } else if(!times->drained) {
+    fprintf(stderr, "Emergency stop (%s) written %.3f ms after it was called for, "
+            "but not yet sent after %.3f ms!\n",
+            why, (times->written - since) / 1e6, (gcestop_now() - since) / 1e6);
+  } else {
+    fprintf(stderr, "Emergency stop (%s) sent %.3f ms after it was called for "
+            "(written after %.3f ms).\n",
+            why, (times->drained - since) / 1e6, (times->written - since) / 1e6);
+  }
+}
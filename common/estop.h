@@ -0,0 +1,37 @@
+#ifndef _ESTOP_H_
+#define _ESTOP_H_
+
+#include <stdint.h>
+
+/* Stops the machine at once.  The leading newline ends whatever line
+ * was partway out when the halt cut in, so that the firmware reads M112
+ * on a line of its own; firmware with an emergency parser acts on it
+ * before anything it has buffered. */
+#define GCESTOP_HALT "\nM112\n"
+
+/* Longest to wait for the halt to leave the port, in ms */
+#define GCESTOP_TIMEOUT 100
+
+/* When a halt went out, in ns on CLOCK_MONOTONIC */
+typedef struct gcestop_times {
+  uint64_t start;               /* gcestop_send was called */
+  uint64_t written;             /* The kernel had all of it */
+  uint64_t drained;             /* Left the port, or 0 if it hadn't yet */
+} gcestop_times;
+
+/* Now, in ns on CLOCK_MONOTONIC. */
+uint64_t gcestop_now(void);
+
+/* Writes GCESTOP_HALT straight to the device at fd, ahead of anything
+ * still queued to send, and waits up to timeout ms for it to be
+ * written and then drained from the port's output buffer.  Returns 0
+ * once drained, 1 if time ran out first, or -1 with errno set if it
+ * couldn't be written at all.  times may be NULL. */
+int gcestop_send(int fd, int timeout, gcestop_times *times);
+
+/* Tells stderr how long the halt, prompted by why, took to go out,
+ * counting from since (e.g. when a signal was read). */
+void gcestop_report(const gcestop_times *times, uint64_t since, int result,
+                    const char *why);
+
+#endif
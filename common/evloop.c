@@ -0,0 +1,493 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+
+#ifdef LINUX
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#else
+#include <poll.h>
+#endif
+
+#include "evloop.h"
+
+enum {
+  WATCH_FD,
+  WATCH_TIMER,
+  WATCH_SIGNAL
+};
+
+/* Events taken from epoll per wait */
+#define MAXEVENTS 64
+
+static gcwatch *new_watch(gcloop *loop, int fd, int kind, gcloop_cb cb,
+                          void *data) {
+  gcwatch *watch = calloc(1, sizeof(gcwatch));
+  if(!watch) {
+    return NULL;
+  }
+  watch->fd = fd;
+  watch->kind = kind;
+  watch->cb = cb;
+  watch->data = data;
+  watch->next = loop->watches;
+  loop->watches = watch;
+  ++loop->count;
+  return watch;
+}
+
+/* Frees the watches removed since the last sweep. */
+static void sweep(gcloop *loop) {
+  gcwatch **link = &loop->watches;
+  while(*link) {
+    gcwatch *watch = *link;
+    if(watch->dead) {
+      *link = watch->next;
+      --loop->count;
+      free(watch);
+    } else {
+      link = &watch->next;
+    }
+  }
+}
+
+static void dispatch(gcloop *loop, gcwatch *watch, unsigned events) {
+  if(!watch->dead) {
+    watch->cb(loop, watch, events);
+  }
+}
+
+#ifdef LINUX
+
+static int block_signal(int signo, int how) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, signo);
+  return pthread_sigmask(how, &set, NULL) == 0 ? 0 : -1;
+}
+
+static uint32_t epoll_events(unsigned events) {
+  return ((events & GCLOOP_READ) ? EPOLLIN : 0)
+    | ((events & GCLOOP_WRITE) ? EPOLLOUT : 0)
+    | ((events & GCLOOP_EDGE) ? EPOLLET : 0);
+}
+
+int gcloop_init(gcloop *loop) {
+  loop->watches = NULL;
+  loop->count = 0;
+  loop->running = 0;
+  loop->fd = epoll_create1(EPOLL_CLOEXEC);
+  return loop->fd < 0 ? -1 : 0;
+}
+
+/* Starts watching a descriptor of our own for reading. */
+static gcwatch *add_own(gcloop *loop, int fd, int kind, gcloop_cb cb,
+                        void *data) {
+  gcwatch *watch = new_watch(loop, fd, kind, cb, data);
+  if(!watch) {
+    close(fd);
+    return NULL;
+  }
+  /* Drained completely on each wakeup, so edge-triggered */
+  watch->events = GCLOOP_READ | GCLOOP_EDGE;
+  struct epoll_event ev;
+  ev.events = epoll_events(watch->events);
+  ev.data.ptr = watch;
+  if(epoll_ctl(loop->fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    const int saved = errno;
+    gcloop_remove(loop, watch);
+    errno = saved;
+    return NULL;
+  }
+  return watch;
+}
+
+gcwatch *gcloop_fd(gcloop *loop, int fd, unsigned events, gcloop_cb cb,
+                   void *data) {
+  gcwatch *watch = new_watch(loop, fd, WATCH_FD, cb, data);
+  if(watch && gcloop_set(loop, watch, events) < 0) {
+    const int saved = errno;
+    gcloop_remove(loop, watch);
+    errno = saved;
+    return NULL;
+  }
+  return watch;
+}
+
+int gcloop_set(gcloop *loop, gcwatch *watch, unsigned events) {
+  /* A descriptor watched for nothing is taken out entirely, or a hangup
+   * would still be reported on it over and over */
+  struct epoll_event ev;
+  ev.events = epoll_events(events);
+  ev.data.ptr = watch;
+  int result = 0;
+  if(!(watch->events & (GCLOOP_READ | GCLOOP_WRITE))) {
+    if(events & (GCLOOP_READ | GCLOOP_WRITE)) {
+      result = epoll_ctl(loop->fd, EPOLL_CTL_ADD, watch->fd, &ev);
+    }
+  } else if(events & (GCLOOP_READ | GCLOOP_WRITE)) {
+    result = epoll_ctl(loop->fd, EPOLL_CTL_MOD, watch->fd, &ev);
+  } else {
+    result = epoll_ctl(loop->fd, EPOLL_CTL_DEL, watch->fd, &ev);
+  }
+  if(result == 0) {
+    watch->events = events;
+  }
+  return result;
+}
+
+gcwatch *gcloop_timer(gcloop *loop, unsigned ms, unsigned interval,
+                      gcloop_cb cb, void *data) {
+  const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if(fd < 0) {
+    return NULL;
+  }
+  gcwatch *watch = add_own(loop, fd, WATCH_TIMER, cb, data);
+  if(watch && gcloop_timer_set(loop, watch, ms, interval) < 0) {
+    const int saved = errno;
+    gcloop_remove(loop, watch);
+    errno = saved;
+    return NULL;
+  }
+  return watch;
+}
+
+int gcloop_timer_set(gcloop *loop, gcwatch *watch, unsigned ms,
+                     unsigned interval) {
+  (void)loop;
+  struct itimerspec spec;
+  spec.it_value.tv_sec = ms / 1000;
+  spec.it_value.tv_nsec = (ms % 1000) * 1000000L;
+  spec.it_interval.tv_sec = interval / 1000;
+  spec.it_interval.tv_nsec = (interval % 1000) * 1000000L;
+  return timerfd_settime(watch->fd, 0, &spec, NULL);
+}
+
+gcwatch *gcloop_signal(gcloop *loop, int signo, gcloop_cb cb, void *data) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, signo);
+  if(block_signal(signo, SIG_BLOCK) < 0) {
+    return NULL;
+  }
+  const int fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+  if(fd < 0) {
+    block_signal(signo, SIG_UNBLOCK);
+    return NULL;
+  }
+  gcwatch *watch = add_own(loop, fd, WATCH_SIGNAL, cb, data);
+  if(watch) {
+    watch->value = signo;
+  }
+  return watch;
+}
+
+void gcloop_remove(gcloop *loop, gcwatch *watch) {
+  if(watch->dead) {
+    return;
+  }
+  watch->dead = 1;
+  if(watch->events & (GCLOOP_READ | GCLOOP_WRITE)) {
+    struct epoll_event ev;
+    epoll_ctl(loop->fd, EPOLL_CTL_DEL, watch->fd, &ev);
+  }
+  if(watch->kind != WATCH_FD) {
+    close(watch->fd);
+  }
+  if(watch->kind == WATCH_SIGNAL) {
+    block_signal(watch->value, SIG_UNBLOCK);
+  }
+  if(!loop->running) {
+    sweep(loop);
+  }
+}
+
+/* Reads everything pending on a timer or signal descriptor, calling
+ * back for each expiry count or signal. */
+static void drain(gcloop *loop, gcwatch *watch) {
+  if(watch->kind == WATCH_TIMER) {
+    uint64_t expirations;
+    if(read(watch->fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+      watch->value = expirations;
+      dispatch(loop, watch, GCLOOP_READ);
+    }
+  } else {
+    struct signalfd_siginfo info;
+    while(!watch->dead
+          && read(watch->fd, &info, sizeof(info)) == sizeof(info)) {
+      watch->value = info.ssi_signo;
+      dispatch(loop, watch, GCLOOP_READ);
+    }
+  }
+}
+
+int gcloop_run(gcloop *loop, int timeout) {
+  struct epoll_event evs[MAXEVENTS];
+  const int n = epoll_wait(loop->fd, evs, MAXEVENTS, timeout);
+  if(n < 0) {
+    return -1;
+  }
+  loop->running = 1;
+  int i;
+  for(i = 0; i < n; ++i) {
+    gcwatch *watch = evs[i].data.ptr;
+    if(watch->dead) {
+      continue;
+    }
+    if(watch->kind != WATCH_FD) {
+      drain(loop, watch);
+      continue;
+    }
+    const uint32_t e = evs[i].events;
+    /* A hangup is also readable, so that the reader sees EOF */
+    const unsigned events = ((e & (EPOLLIN | EPOLLHUP)) ? GCLOOP_READ : 0)
+      | ((e & EPOLLOUT) ? GCLOOP_WRITE : 0)
+      | ((e & EPOLLERR) ? GCLOOP_ERROR : 0);
+    dispatch(loop, watch, events);
+  }
+  loop->running = 0;
+  sweep(loop);
+  return n;
+}
+
+void gcloop_free(gcloop *loop) {
+  gcwatch *watch;
+  loop->running = 1;
+  for(watch = loop->watches; watch; watch = watch->next) {
+    gcloop_remove(loop, watch);
+  }
+  loop->running = 0;
+  sweep(loop);
+  if(loop->fd >= 0) {
+    close(loop->fd);
+    loop->fd = -1;
+  }
+}
+
+#else  /* !LINUX */
+
+/* Signals arrive as bytes on this pipe */
+static int sigpipe[2] = {-1, -1};
+
+static void on_signal(int signo) {
+  const unsigned char byte = signo;
+  const int saved = errno;
+  if(write(sigpipe[1], &byte, 1) < 0) {
+    /* Full; the signal is already pending anyway */
+  }
+  errno = saved;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int gcloop_init(gcloop *loop) {
+  loop->watches = NULL;
+  loop->count = 0;
+  loop->running = 0;
+  loop->fd = -1;
+  return 0;
+}
+
+gcwatch *gcloop_fd(gcloop *loop, int fd, unsigned events, gcloop_cb cb,
+                   void *data) {
+  gcwatch *watch = new_watch(loop, fd, WATCH_FD, cb, data);
+  if(watch) {
+    watch->events = events;
+  }
+  return watch;
+}
+
+int gcloop_set(gcloop *loop, gcwatch *watch, unsigned events) {
+  (void)loop;
+  watch->events = events;
+  return 0;
+}
+
+gcwatch *gcloop_timer(gcloop *loop, unsigned ms, unsigned interval,
+                      gcloop_cb cb, void *data) {
+  gcwatch *watch = new_watch(loop, -1, WATCH_TIMER, cb, data);
+  if(watch) {
+    gcloop_timer_set(loop, watch, ms, interval);
+  }
+  return watch;
+}
+
+int gcloop_timer_set(gcloop *loop, gcwatch *watch, unsigned ms,
+                     unsigned interval) {
+  (void)loop;
+  watch->deadline = ms ? now_ns() + ms * 1000000ULL : 0;
+  watch->interval = interval * 1000000ULL;
+  return 0;
+}
+
+gcwatch *gcloop_signal(gcloop *loop, int signo, gcloop_cb cb, void *data) {
+  if(sigpipe[0] < 0) {
+    if(pipe(sigpipe) < 0) {
+      return NULL;
+    }
+    int i;
+    for(i = 0; i < 2; ++i) {
+      fcntl(sigpipe[i], F_SETFL, fcntl(sigpipe[i], F_GETFL) | O_NONBLOCK);
+      fcntl(sigpipe[i], F_SETFD, FD_CLOEXEC);
+    }
+  }
+  gcwatch *watch = new_watch(loop, sigpipe[0], WATCH_SIGNAL, cb, data);
+  if(!watch) {
+    return NULL;
+  }
+  watch->value = signo;
+  struct sigaction sa;
+  sa.sa_handler = &on_signal;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(signo, &sa, NULL);
+  return watch;
+}
+
+void gcloop_remove(gcloop *loop, gcwatch *watch) {
+  if(watch->dead) {
+    return;
+  }
+  watch->dead = 1;
+  if(watch->kind == WATCH_SIGNAL) {
+    signal(watch->value, SIG_DFL);
+  }
+  if(!loop->running) {
+    sweep(loop);
+  }
+}
+
+int gcloop_run(gcloop *loop, int timeout) {
+  /* Rebuilt every time; this is the fallback */
+  struct pollfd *fds = malloc((loop->count + 1) * sizeof(struct pollfd));
+  gcwatch **owners = malloc((loop->count + 1) * sizeof(gcwatch*));
+  if(!fds || !owners) {
+    free(fds);
+    free(owners);
+    errno = ENOMEM;
+    return -1;
+  }
+  nfds_t n = 0;
+  char signals = 0;
+  uint64_t next = 0;
+  gcwatch *watch;
+  for(watch = loop->watches; watch; watch = watch->next) {
+    if(watch->dead) {
+      continue;
+    }
+    switch(watch->kind) {
+    case WATCH_FD:
+      if(watch->events & (GCLOOP_READ | GCLOOP_WRITE)) {
+        fds[n].fd = watch->fd;
+        fds[n].events = ((watch->events & GCLOOP_READ) ? POLLIN : 0)
+          | ((watch->events & GCLOOP_WRITE) ? POLLOUT : 0);
+        owners[n++] = watch;
+      }
+      break;
+
+    case WATCH_TIMER:
+      if(watch->deadline && (!next || watch->deadline < next)) {
+        next = watch->deadline;
+      }
+      break;
+
+    case WATCH_SIGNAL:
+      signals = 1;
+      break;
+    }
+  }
+  if(signals) {
+    fds[n].fd = sigpipe[0];
+    fds[n].events = POLLIN;
+    owners[n++] = NULL;
+  }
+  if(next) {
+    const uint64_t t = now_ns();
+    const int until = next > t ? (int)((next - t + 999999) / 1000000) : 0;
+    if(timeout < 0 || until < timeout) {
+      timeout = until;
+    }
+  }
+
+  const int result = poll(fds, n, timeout);
+  if(result < 0) {
+    free(fds);
+    free(owners);
+    return errno == EINTR ? 0 : -1;
+  }
+  loop->running = 1;
+  int ran = 0;
+  nfds_t i;
+  for(i = 0; i < n; ++i) {
+    const short e = fds[i].revents;
+    if(!e) {
+      continue;
+    }
+    if(owners[i]) {
+      dispatch(loop, owners[i], ((e & (POLLIN | POLLHUP)) ? GCLOOP_READ : 0)
+               | ((e & POLLOUT) ? GCLOOP_WRITE : 0)
+               | ((e & (POLLERR | POLLNVAL)) ? GCLOOP_ERROR : 0));
+      ++ran;
+    } else {
+      unsigned char signos[64];
+      ssize_t got;
+      while((got = read(sigpipe[0], signos, sizeof(signos))) > 0) {
+        ssize_t s;
+        for(s = 0; s < got; ++s) {
+          for(watch = loop->watches; watch; watch = watch->next) {
+            if(watch->kind == WATCH_SIGNAL && watch->value == signos[s]) {
+              dispatch(loop, watch, GCLOOP_READ);
+              ++ran;
+            }
+          }
+        }
+      }
+    }
+  }
+  if(next) {
+    const uint64_t t = now_ns();
+    for(watch = loop->watches; watch; watch = watch->next) {
+      if(watch->kind == WATCH_TIMER && watch->deadline
+         && watch->deadline <= t && !watch->dead) {
+        watch->value = 1;
+        if(watch->interval) {
+          const uint64_t late = (t - watch->deadline) / watch->interval;
+          watch->value += late;
+          watch->deadline += (late + 1) * watch->interval;
+        } else {
+          watch->deadline = 0;
+        }
+        dispatch(loop, watch, GCLOOP_READ);
+        ++ran;
+      }
+    }
+  }
+  loop->running = 0;
+  sweep(loop);
+  free(fds);
+  free(owners);
+  return ran;
+}
+
+void gcloop_free(gcloop *loop) {
+  gcwatch *watch;
+  loop->running = 1;
+  for(watch = loop->watches; watch; watch = watch->next) {
+    gcloop_remove(loop, watch);
+  }
+  loop->running = 0;
+  sweep(loop);
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef _EVLOOP_H_
+#define _EVLOOP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* What a descriptor is watched for, and what a callback is told. */
+#define GCLOOP_READ 0x1
+#define GCLOOP_WRITE 0x2
+#define GCLOOP_ERROR 0x4        /* Reported, never asked for */
+/* Report readiness only when it changes; the callback must then read or
+ * write until EAGAIN.  Watches are level-triggered otherwise. */
+#define GCLOOP_EDGE 0x8
+
+struct gcloop;
+struct gcwatch;
+
+typedef void (*gcloop_cb)(struct gcloop *loop, struct gcwatch *watch,
+                          unsigned events);
+
+typedef struct gcwatch {
+  int fd;
+  unsigned events;              /* GCLOOP_ flags asked for */
+  gcloop_cb cb;
+  void *data;                   /* For the use of cb */
+  /* For a timer, how many times it expired; for a signal, its number */
+  uint64_t value;
+
+  /* Private */
+  int kind;
+  uint64_t deadline, interval;  /* Timers without timerfd, in ns */
+  char dead;
+  struct gcwatch *next;
+} gcwatch;
+
+/* Waits for descriptors to become ready, timers to expire and signals
+ * to arrive, and calls back for each.  On Linux this is epoll, with a
+ * timerfd per timer and a signalfd per signal, so nothing is rebuilt or
+ * rescanned per wait; elsewhere it falls back to poll and a self-pipe. */
+typedef struct gcloop {
+  int fd;                       /* epoll, or -1 */
+  gcwatch *watches;
+  size_t count;
+  char running;                 /* Removed watches are freed afterwards */
+} gcloop;
+
+/* Returns 0 on success, or -1 with errno set. */
+int gcloop_init(gcloop *loop);
+
+/* Removes every watch, unblocking their signals. */
+void gcloop_free(gcloop *loop);
+
+/* Calls cb whenever fd is ready for events.  Returns NULL with errno
+ * set on failure. */
+gcwatch *gcloop_fd(gcloop *loop, int fd, unsigned events, gcloop_cb cb,
+                   void *data);
+
+/* Changes what a descriptor is watched for; 0 stops watching it for
+ * now. */
+int gcloop_set(gcloop *loop, gcwatch *watch, unsigned events);
+
+/* Calls cb after ms milliseconds, then every interval milliseconds
+ * unless that's 0. */
+gcwatch *gcloop_timer(gcloop *loop, unsigned ms, unsigned interval,
+                      gcloop_cb cb, void *data);
+
+/* Rearms a timer as above; ms of 0 disarms it. */
+int gcloop_timer_set(gcloop *loop, gcwatch *watch, unsigned ms,
+                     unsigned interval);
+
+/* Blocks signo and calls cb when it arrives instead.  Must be called
+ * before any threads are started, so that none of them take it. */
+gcwatch *gcloop_signal(gcloop *loop, int signo, gcloop_cb cb, void *data);
+
+/* Stops and frees a watch.  Safe to call from any callback. */
+void gcloop_remove(gcloop *loop, gcwatch *watch);
+
+/* Waits up to timeout milliseconds (forever if negative) and runs the
+ * callbacks for whatever happened.  Returns the number run, 0 if the
+ * timeout expired, or -1 with errno set. */
+int gcloop_run(gcloop *loop, int timeout);
+
+#endif
@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef UNIX
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#include "gcode.h"
+#include "gcbin.h"
+
+static uint64_t align8(uint64_t n) {
+  return (n + 7) & ~(uint64_t)7;
+}
+
+int gcbin_detect(const char *data, size_t len) {
+  return len >= GCBIN_MAGICLEN && memcmp(data, GCBIN_MAGIC, GCBIN_MAGICLEN) == 0;
+}
+
+/* Pads out to offset, then writes size bytes of data. */
+static int write_section(FILE *out, uint64_t *pos, uint64_t offset,
+                         const void *data, size_t size) {
+  static const char zeroes[8];
+  if(offset > *pos && fwrite(zeroes, 1, offset - *pos, out) != offset - *pos) {
+    return -1;
+  }
+  if(size && fwrite(data, 1, size, out) != size) {
+    return -1;
+  }
+  *pos = offset + size;
+  return 0;
+}
+
+int gcbin_write(const gcprogram *prog, FILE *out, int withsrc) {
+  const uint64_t blocks = prog->blockcnt, words = prog->wordcnt;
+  const unsigned none = 0;
+  withsrc = withsrc && prog->srcoff;
+
+  gcbin_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, GCBIN_MAGIC, GCBIN_MAGICLEN);
+  header.version = GCBIN_VERSION;
+  header.byteorder = GCBIN_BYTEORDER;
+  header.flags = withsrc ? GCBIN_SRC : 0;
+  header.blockcnt = blocks;
+  header.wordcnt = words;
+
+  /* Widest elements first keeps everything aligned */
+  uint64_t offset = align8(sizeof(header));
+  if(withsrc) {
+    header.srcoff = offset;
+    offset = align8(offset + blocks * sizeof(uint64_t));
+  }
+  header.nums = offset;
+  offset = align8(offset + words * sizeof(float));
+  header.wordidx = offset;
+  offset = align8(offset + (blocks + 1) * sizeof(unsigned));
+  header.line = offset;
+  offset = align8(offset + blocks * sizeof(unsigned));
+  header.real_line = offset;
+  offset = align8(offset + blocks * sizeof(unsigned));
+  if(withsrc) {
+    header.srclen = offset;
+    offset = align8(offset + blocks * sizeof(unsigned));
+  }
+  header.letters = offset;
+  offset = align8(offset + words);
+  header.optdelete = offset;
+
+  uint64_t pos = 0;
+  if(write_section(out, &pos, 0, &header, sizeof(header)) < 0
+     || (withsrc && write_section(out, &pos, header.srcoff, prog->srcoff,
+                                  blocks * sizeof(uint64_t)) < 0)
+     || write_section(out, &pos, header.nums, prog->nums, words * sizeof(float)) < 0
+     || write_section(out, &pos, header.wordidx,
+                      prog->wordidx ? (const void*)prog->wordidx : (const void*)&none,
+                      (blocks + 1) * sizeof(unsigned)) < 0
+     || write_section(out, &pos, header.line, prog->line, blocks * sizeof(unsigned)) < 0
+     || write_section(out, &pos, header.real_line, prog->real_line,
+                      blocks * sizeof(unsigned)) < 0
+     || (withsrc && write_section(out, &pos, header.srclen, prog->srclen,
+                                  blocks * sizeof(unsigned)) < 0)
+     || write_section(out, &pos, header.letters, prog->letters, words) < 0
+     || write_section(out, &pos, header.optdelete, prog->optdelete, blocks) < 0) {
+    return -1;
+  }
+  return fflush(out) == 0 ? 0 : -1;
+}
+
+#ifdef UNIX
+/* Checks that a section lies within the file. */
+static int section_ok(uint64_t offset, uint64_t count, size_t size, uint64_t filesize) {
+  return (offset & 7) == 0 && offset <= filesize
+    && count <= (filesize - offset) / size;
+}
+#endif
+
+int gcbin_load(gcparse *parse, int fd) {
+#ifdef UNIX
+  gcprogram *prog = parse->prog;
+  struct stat st;
+  gcbin_header header;
+  if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+     || (size_t)st.st_size < sizeof(header)
+     || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+     || !gcbin_detect(header.magic, sizeof(header.magic))) {
+    return GCBIN_NOT_BINARY;
+  }
+  if(header.byteorder != GCBIN_BYTEORDER) {
+    return GCBIN_BAD_BYTEORDER;
+  }
+  if(header.version != GCBIN_VERSION) {
+    return GCBIN_BAD_VERSION;
+  }
+
+  const uint64_t size = st.st_size;
+  const uint64_t blocks = header.blockcnt, words = header.wordcnt;
+  const int withsrc = header.flags & GCBIN_SRC;
+  if(blocks >= size || words >= size || words > (unsigned)-1
+     || !section_ok(header.letters, words, 1, size)
+     || !section_ok(header.nums, words, sizeof(float), size)
+     || !section_ok(header.wordidx, blocks + 1, sizeof(unsigned), size)
+     || !section_ok(header.line, blocks, sizeof(unsigned), size)
+     || !section_ok(header.real_line, blocks, sizeof(unsigned), size)
+     || !section_ok(header.optdelete, blocks, 1, size)
+     || (withsrc && (!section_ok(header.srcoff, blocks, sizeof(uint64_t), size)
+                     || !section_ok(header.srclen, blocks, sizeof(unsigned), size)))) {
+    return GCBIN_CORRUPT;
+  }
+
+  /* Private and writable so that the program can be modified like any
+   * other; pages are only copied if that happens. */
+  char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(base == MAP_FAILED) {
+    return GCBIN_CORRUPT;
+  }
+
+  /* Indices are the one thing that could send readers astray */
+  const unsigned *wordidx = (const unsigned*)(base + header.wordidx);
+  uint64_t b;
+  int ok = wordidx[0] == 0 && wordidx[blocks] == words;
+  for(b = 0; ok && b < blocks; ++b) {
+    ok = wordidx[b + 1] >= wordidx[b];
+  }
+  if(!ok) {
+    munmap(base, size);
+    return GCBIN_CORRUPT;
+  }
+
+  /* Decoding needs the same room as parsing would give it (see
+   * gcprogram_reserve) */
+  prog->insns = malloc((words + blocks ? words + blocks : 1) * sizeof(gcinsn));
+  prog->operands = malloc((words ? words : 1) * sizeof(float));
+  prog->insnidx = malloc((blocks + 1) * sizeof(unsigned));
+  if(!prog->insns || !prog->operands || !prog->insnidx) {
+    free(prog->insns);
+    free(prog->operands);
+    free(prog->insnidx);
+    prog->insns = NULL;
+    prog->operands = NULL;
+    prog->insnidx = NULL;
+    munmap(base, size);
+    return GCBIN_NO_MEMORY;
+  }
+
+  prog->letters = base + header.letters;
+  prog->nums = (float*)(base + header.nums);
+  prog->wordidx = (unsigned*)(base + header.wordidx);
+  prog->line = (unsigned*)(base + header.line);
+  prog->real_line = (unsigned*)(base + header.real_line);
+  prog->optdelete = base + header.optdelete;
+  prog->srcoff = withsrc ? (uint64_t*)(base + header.srcoff) : NULL;
+  prog->srclen = withsrc ? (unsigned*)(base + header.srclen) : NULL;
+  prog->keepsrc = (withsrc != 0);
+  prog->wordcnt = prog->wordcap = words;
+  prog->insncap = words + blocks;
+  prog->opercap = words;
+  prog->blockcap = blocks;
+  prog->mapping = base;
+  prog->mappinglen = size;
+
+  /* gc_decode_block decodes the last block, as it's just been parsed */
+  prog->insncnt = 0;
+  prog->opercnt = 0;
+  prog->insnidx[0] = 0;
+  for(b = 0; b < blocks; ++b) {
+    prog->blockcnt = b + 1;
+    gc_decode_block(prog);
+    size_t i;
+    for(i = prog->insnidx[b]; i < prog->insnidx[b + 1]; ++i) {
+      if(prog->insns[i].op == GCOP_UNSUPPORTED) {
+        const unsigned w = prog->insns[i].operand;
+        parse->unsupported(parse, prog->real_line[b], prog->letters[w],
+                           prog->nums[w]);
+      }
+    }
+  }
+  return 0;
+#else
+  (void)parse;
+  (void)fd;
+  return GCBIN_NOT_BINARY;
+#endif
+}
+
+const char *gcbin_strerror(int error) {
+  switch(error) {
+  case 0:
+    return "No error.";
+
+  case GCBIN_NOT_BINARY:
+    return "Not compiled gcode.";
+
+  case GCBIN_BAD_VERSION:
+    return "Compiled gcode is from an incompatible version; recompile it.";
+
+  case GCBIN_BAD_BYTEORDER:
+    return "Compiled gcode was written on a machine with a different byte order; recompile it.";
+
+  case GCBIN_CORRUPT:
+    return "Compiled gcode is corrupt or truncated.";
+
+  case GCBIN_NO_MEMORY:
+    return "Out of memory for compiled gcode.";
+
+  default:
+    return "Unexpected error.  This is an internal bug.";
+  }
+}
@@ -0,0 +1,64 @@
+#ifndef _GCBIN_H_
+#define _GCBIN_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "program.h"
+#include "gcode.h"
+
+/* Compiled gcode: a gcprogram's words and per-block arrays written out
+ * as they are in memory, so that they're loaded with a single mmap.
+ * The decoded instructions are not stored, as they can't stand in for
+ * the words: loading decodes every block again into arrays on the heap,
+ * which is cheap next to parsing but does touch every word.  The file
+ * starts with a gcbin_header; each array follows at
+ * the (8-byte aligned) offset the header gives for it.  Files are only
+ * readable on hosts with the same byte order as the one that wrote
+ * them. */
+
+#define GCBIN_MAGIC "\x89GCB\r\n\x1a\n"
+#define GCBIN_MAGICLEN 8
+#define GCBIN_VERSION 3
+#define GCBIN_BYTEORDER 0x01020304
+
+/* Header flags */
+#define GCBIN_SRC 0x1           /* srcoff and srclen are present */
+
+typedef struct gcbin_header {
+  char magic[GCBIN_MAGICLEN];
+  uint32_t version;
+  uint32_t byteorder;
+  uint32_t flags;
+  uint32_t reserved;
+  uint64_t blockcnt, wordcnt;
+  /* Offsets from the start of the file */
+  uint64_t letters, nums, wordidx, line, real_line, optdelete;
+  uint64_t srcoff, srclen;
+} gcbin_header;
+
+/* Returns nonzero if the len bytes at data begin with GCBIN_MAGIC. */
+int gcbin_detect(const char *data, size_t len);
+
+/* Writes prog to out, including source offsets if prog has them and
+ * withsrc is set.  Returns 0 on success or -1 on I/O error. */
+int gcbin_write(const gcprogram *prog, FILE *out, int withsrc);
+
+/* Errors from gcbin_load */
+#define GCBIN_NOT_BINARY -1     /* Not compiled gcode; parse it as text */
+#define GCBIN_BAD_VERSION -2
+#define GCBIN_BAD_BYTEORDER -3
+#define GCBIN_CORRUPT -4
+#define GCBIN_NO_MEMORY -5      /* For the decoded instructions */
+
+/* Maps the compiled gcode open on fd (which must be a regular file)
+ * into parse->prog, which should be freshly initialized, and decodes
+ * its blocks, passing each unsupported word to parse->unsupported as
+ * parsing the text would have.  Returns 0 on success or one of the
+ * errors above.  fd may be closed afterwards. */
+int gcbin_load(gcparse *parse, int fd);
+
+/* Returns a human-readable interpretation of a gcbin_load error. */
+const char *gcbin_strerror(int error);
+
+#endif
@@ -0,0 +1,43 @@
+#include "gcmap.h"
+
+#ifdef UNIX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+int gcmap_open(gcmap *map, int fd) {
+  map->data = NULL;
+  map->len = 0;
+#ifdef UNIX
+  struct stat st;
+  if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    return -1;
+  }
+  if(st.st_size == 0) {
+    /* Nothing to map, but nothing to read either */
+    return 0;
+  }
+
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(data == MAP_FAILED) {
+    return -1;
+  }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+  map->data = data;
+  map->len = st.st_size;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+void gcmap_close(gcmap *map) {
+#ifdef UNIX
+  if(map->data) {
+    munmap((void*)map->data, map->len);
+  }
+#endif
+  map->data = NULL;
+  map->len = 0;
+}
@@ -0,0 +1,20 @@
+#ifndef _GCMAP_H_
+#define _GCMAP_H_
+
+#include <stddef.h>
+
+/* A read-only mapping of an entire gcode file. */
+typedef struct gcmap {
+  const char *data;
+  size_t len;
+} gcmap;
+
+/* Maps the file open on fd for sequential reading.  Returns 0 on
+ * success, or -1 if fd is not a regular file (e.g. a pipe or a tty) or
+ * can't be mapped, in which case it should be read normally.  fd may be
+ * closed once this returns. */
+int gcmap_open(gcmap *map, int fd);
+
+void gcmap_close(gcmap *map);
+
+#endif
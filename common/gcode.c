@@ -1,103 +1,387 @@
+#define _GNU_SOURCE             /* strtof_l */
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <ctype.h>
+#include <float.h>
+#include <limits.h>
+#include <locale.h>
+#include <pthread.h>
+#ifdef APPLE
+#include <xlocale.h>
+#endif
 
 #include "gcode.h"
+#include "scan.h"
+#include "diag.h"
+#include "trace.h"
 
-/* Finds the next non-whitespace character. */
-int next_dark(char *buffer, size_t len, size_t i) {
-  for(; i < len; ++i) {
-    switch(buffer[i]) {
-    case ' ':
-    case '\t':
-    case '\r':
-    case '\n':
-      break;
-      
-    default:
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SWAR_DIGITS
+#endif
+
+#define ONES 0x0101010101010101ULL
+
+/* Reads a run of up to 8 decimal digits from buffer into *value,
+ * returning how many there were.  When 8 bytes are available they are
+ * examined as one word rather than byte by byte. */
+static unsigned read_digits(const char *buffer, size_t len, uint32_t *value) {
+#ifdef SWAR_DIGITS
+  if(len >= 8) {
+    uint64_t v;
+    memcpy(&v, buffer, 8);
+    /* A byte is a digit iff its high nibble is 3 and its low nibble
+     * is at most 9; neither test can carry between bytes. */
+    const uint64_t bad = ((v & (0xF0 * ONES)) ^ (0x30 * ONES))
+      | (((v & (0x0F * ONES)) + (0x06 * ONES)) & (0x10 * ONES));
+    const uint64_t badbyte = (((bad & (0x7F * ONES)) + (0x7F * ONES)) | bad) & (0x80 * ONES);
+    const unsigned n = badbyte ? __builtin_ctzll(badbyte) / 8 : 8;
+    if(n == 0) {
+      return 0;
+    }
+    /* Right-align the digits so that the unused leading bytes act as
+     * leading zeroes, then combine pairwise. */
+    uint64_t d = v & (0x0F * ONES);
+    d <<= 8 * (8 - n);
+    d = (d * 10) + (d >> 8);
+    d = (((d & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)))
+         + (((d >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+    *value = (uint32_t)d;
+    return n;
+  }
+#endif
+  unsigned n;
+  uint32_t d = 0;
+  for(n = 0; n < len && n < 8 && buffer[n] >= '0' && buffer[n] <= '9'; ++n) {
+    d = d * 10 + (buffer[n] - '0');
+  }
+  *value = d;
+  return n;
+}
+
+static const uint64_t pow10_int[] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+  10000000ULL, 100000000ULL
+};
+
+static const float pow10_float[] = {
+  1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+};
+
+static const double pow10_double[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Accumulates a run of digits onto *mantissa.  Returns the number of
+ * digits read; *overflow is set if any were lost. */
+static size_t read_digit_run(const char *buffer, size_t len, uint64_t *mantissa,
+                             unsigned *sigdigits, char *overflow) {
+  size_t i = 0;
+  for(;;) {
+    uint32_t chunk;
+    const unsigned n = read_digits(buffer + i, len - i, &chunk);
+    if(n == 0) {
+      return i;
+    }
+    if(*mantissa || chunk) {
+      *sigdigits += n;
+    }
+    if(*sigdigits > 19) {
+      *overflow = 1;
+    } else {
+      *mantissa = *mantissa * pow10_int[n] + chunk;
+    }
+    i += n;
+    if(n < 8) {
       return i;
     }
   }
+}
+
+static locale_t c_locale;
+static pthread_once_t c_locale_once = PTHREAD_ONCE_INIT;
+
+static void init_c_locale(void) {
+  c_locale = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+}
+
+/* Slow path for numbers which can't be converted exactly with a
+ * single floating point operation.  Goes straight to float, as rounding
+ * to double first can land exactly halfway between two floats.  Returns
+ * len, or 0 for numbers too long to copy, which no gcode needs and
+ * which truncating would silently change. */
+static size_t parse_float_slow(const char *buffer, size_t len, float *result) {
+  char copy[128];
+  if(len >= sizeof(copy)) {
+    return 0;
+  }
+  memcpy(copy, buffer, len);
+  copy[len] = 0;
+  pthread_once(&c_locale_once, init_c_locale);
+  if(c_locale) {
+    *result = strtof_l(copy, NULL, c_locale);
+  } else {
+    *result = strtof(copy, NULL);
+  }
   return len;
 }
 
-gcblock *parse_block(char *buffer, unsigned len) {
-  size_t i = next_dark(buffer, len, 0);
+size_t gc_parse_float(const char *buffer, size_t len, float *result) {
+  size_t i = 0;
+  char negative = 0;
+  if(i < len && (buffer[i] == '-' || buffer[i] == '+')) {
+    negative = (buffer[i] == '-');
+    ++i;
+  }
+
+  uint64_t mantissa = 0;
+  unsigned sigdigits = 0;
+  char overflow = 0;
+  const size_t intdigits = read_digit_run(buffer + i, len - i, &mantissa,
+                                          &sigdigits, &overflow);
+  i += intdigits;
+  size_t fracdigits = 0;
+  if(i < len && buffer[i] == '.') {
+    ++i;
+    fracdigits = read_digit_run(buffer + i, len - i, &mantissa,
+                                &sigdigits, &overflow);
+    i += fracdigits;
+  }
+  if(intdigits + fracdigits == 0 && !overflow) {
+    return 0;
+  }
+
+  float value;
+  if(!overflow && mantissa <= (1ULL << 24) && fracdigits <= 10) {
+    /* Both operands are exact, so the quotient is correctly rounded */
+    value = (float)mantissa / pow10_float[fracdigits];
+  } else if(!overflow && mantissa <= (1ULL << 53) && fracdigits <= 22) {
+    /* The double quotient is correctly rounded, so rounding it to float
+     * is too unless it landed exactly halfway between two floats. */
+    const double d = (double)mantissa / pow10_double[fracdigits];
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    if((bits & 0x1FFFFFFFULL) == 0x10000000ULL || (d != 0 && d < FLT_MIN)) {
+      return parse_float_slow(buffer, i, result);
+    }
+    value = (float)d;
+  } else {
+    return parse_float_slow(buffer, i, result);
+  }
+
+  *result = negative ? -value : value;
+  return i;
+}
+
+size_t gc_parse_uint(const char *buffer, size_t len, unsigned long *result) {
+  size_t i = 0;
+  unsigned long value = 0;
+  for(;;) {
+    uint32_t chunk;
+    const unsigned n = read_digits(buffer + i, len - i, &chunk);
+    if(n == 0) {
+      break;
+    }
+    if(value > (ULONG_MAX - chunk) / pow10_int[n]) {
+      return 0;
+    }
+    value = value * pow10_int[n] + chunk;
+    i += n;
+    if(n < 8) {
+      break;
+    }
+  }
+  *result = value;
+  return i;
+}
+
+static int parse_words(gcprogram *prog, const char *buffer, size_t len) {
+  size_t i = gc_skip_space(buffer, len, 0);
   if(i == len) {
-    return NULL;
+    return 0;
   }
 
-  gcblock *block = malloc(sizeof(gcblock));
-  block->next = NULL;
-  block->line = 0;
-  block->optdelete = 0;
-  block->words = NULL;
-  block->wordcnt = 0;
-  /* We can't fill these in here */
-  block->index = 0;
-  block->real_line = 0;
+  /* Every word takes at least two characters, so this is enough room
+   * to write them without further checks. */
+  if(gcprogram_reserve(prog, 1, len / 2 + 1) < 0) {
+    return -1;
+  }
+  const size_t b = prog->blockcnt;
+  size_t w = prog->wordcnt;
+  prog->line[b] = 0;
+  prog->optdelete[b] = 0;
+  prog->real_line[b] = 0;
 
   /* Check for optional delete */
   if(buffer[i] == '/') {
-    block->optdelete = 1;
-    i = next_dark(buffer, len, i + 1);
+    prog->optdelete[b] = 1;
+    i = gc_skip_space(buffer, len, i + 1);
   }
 
   /* Check for line number */
-  if((buffer[i] == 'N' || buffer[i] == 'n') && (i + 1) < len) {
-    i = next_dark(buffer, len, len);
-    char* endptr;
-    block->line = strtol(buffer + i, &endptr, 10);
-    i = next_dark(buffer, len, endptr - buffer);
+  if(i + 1 < len && (buffer[i] == 'N' || buffer[i] == 'n')) {
+    unsigned long line;
+    i = gc_skip_space(buffer, len, i + 1);
+    const size_t numlen = gc_parse_uint(buffer + i, len - i, &line);
+    if(numlen == 0 && i < len && buffer[i] >= '0' && buffer[i] <= '9') {
+      /* Too big */
+      return -1;
+    }
+    i += numlen;
+    prog->line[b] = numlen ? line : 0;
+    i = gc_skip_space(buffer, len, i);
   }
 
   /* Parse words */
-  unsigned allocsize = 0;
   while(i < len) {
     /* Skip comments */
     while(buffer[i] == '(') {
-      for(; i < len && buffer[i] != ')'; ++i);
-      i = next_dark(buffer, len, i + 1);
+      i += gc_find_byte(buffer + i, len - i, ')');
+      i = gc_skip_space(buffer, len, i + 1);
       if(i >= len) {
-        return block;
+        goto done;
       }
     }
     if(buffer[i] == ';') {
-      return block;
-    }
-      
-    if(block->wordcnt == allocsize) {
-      allocsize = 2*(allocsize ? allocsize : 2);
-      block->words = realloc(block->words, allocsize * sizeof(gcword));
+      break;
     }
-    
-    block->words[block->wordcnt].letter = toupper(buffer[i]);
-    i = next_dark(buffer, len, i + 1);
+
+    prog->letters[w] = toupper(buffer[i]);
+    i = gc_skip_space(buffer, len, i + 1);
     if(i == len) {
-      free(block->words);
-      free(block);
-      return NULL;
+      return -1;
     }
 
     /* TODO: Spaces in numbers */
     /* TODO: Gn.m support */
     {
-      char *endptr;
-      
-      block->words[block->wordcnt].num = strtof(buffer + i, &endptr);
-      
-      if(endptr == buffer + i) {
-        free(block->words);
-        free(block);
-        return NULL;
+      const size_t numlen = gc_parse_float(buffer + i, len - i, &prog->nums[w]);
+      if(numlen == 0) {
+        return -1;
       }
 
-      i = next_dark(buffer, len, endptr - buffer);
+      i = gc_skip_space(buffer, len, i + numlen);
     }
-    ++(block->wordcnt);
+    ++w;
   }
 
-  return block;
+ done:
+  prog->wordcnt = w;
+  prog->wordidx[b + 1] = w;
+  prog->blockcnt = b + 1;
+  gc_decode_block(prog);
+  return 1;
+}
+
+int parse_block(gcprogram *prog, const char *buffer, size_t len) {
+  GCTRACE(parse_start, len, 0);
+  const int result = parse_words(prog, buffer, len);
+  GCTRACE(parse_done, result, 0);
+  return result;
+}
+
+static void warn_malformed(gcparse *parse, unsigned real_line,
+                           const char *text, size_t len) {
+  if(parse->diag) {
+    gcdiag_malformed(parse->diag, real_line, text, len);
+    return;
+  }
+  fprintf(stderr, "WARNING: Line %u: Skipping malformed block\n", real_line);
+  fprintf(stderr, "Block: \"%.*s\"\n", (int)len, text);
+}
+
+static void warn_unsupported(gcparse *parse, unsigned real_line, char letter,
+                             float num) {
+  if(parse->diag) {
+    gcdiag_unsupported(parse->diag, real_line, letter, num);
+    return;
+  }
+  if(letter == 'G' || letter == 'M') {
+    fprintf(stderr, "WARNING: Line %u: Skipping unsupported %c code %c%d\n",
+            real_line, letter, letter, (int)num);
+  } else {
+    fprintf(stderr, "WARNING: Line %u: Skipping unrecognized word %c\n",
+            real_line, letter);
+  }
+}
+
+void gcparse_init(gcparse *parse, gcprogram *prog) {
+  parse->prog = prog;
+  parse->lines = 0;
+  parse->offset = 0;
+  parse->malformed = &warn_malformed;
+  parse->unsupported = &warn_unsupported;
+  parse->online = NULL;
+  parse->diag = NULL;
+  parse->data = NULL;
+  parse->stopped = 0;
+}
+
+void gcparse_reset(gcparse *parse) {
+  gcprogram_reset(parse->prog);
+  parse->lines = 0;
+  parse->offset = 0;
+}
+
+/* Returns nonzero if parsing should stop after this line. */
+static int parse_line(gcparse *parse, const char *buffer, size_t len,
+                      uint64_t offset) {
+  gcprogram *prog = parse->prog;
+  const int result = parse_block(prog, buffer, len);
+  if(result == 0) {
+    /* Blank line */
+    return 0;
+  }
+
+  const unsigned real_line = parse->lines + 1;
+  if(result < 0) {
+    parse->malformed(parse, real_line, buffer, len);
+  } else {
+    const size_t b = prog->blockcnt - 1;
+    prog->real_line[b] = real_line;
+    size_t i;
+    for(i = prog->insnidx[b]; i < prog->insnidx[b + 1]; ++i) {
+      if(prog->insns[i].op == GCOP_UNSUPPORTED) {
+        const unsigned w = prog->insns[i].operand;
+        parse->unsupported(parse, real_line, prog->letters[w], prog->nums[w]);
+      }
+    }
+    if(prog->keepsrc) {
+      prog->srcoff[b] = offset;
+      prog->srclen[b] = len;
+    }
+  }
+  return parse->online && parse->online(parse, result, buffer, len);
+}
+
+size_t gcparse_lines(gcparse *parse, const char *buffer, size_t len, int final) {
+  size_t start = 0;
+  parse->stopped = 0;
+  while(start < len) {
+    const size_t eol = start + gc_find_eol(buffer + start, len - start);
+    if(eol == len) {
+      if(final) {
+        parse->stopped = parse_line(parse, buffer + start, len - start,
+                                    parse->offset + start);
+        start = len;
+      }
+      break;
+    }
+    const int stop = parse_line(parse, buffer + start, eol - start,
+                                parse->offset + start);
+    if(buffer[eol] == '\n') {
+      ++parse->lines;
+    }
+    start = eol + 1;
+    if(stop) {
+      parse->stopped = 1;
+      break;
+    }
+  }
+  parse->offset += start;
+  return start;
 }
 
 float dot(const point a, const point b) {
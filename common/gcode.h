@@ -1,8 +1,11 @@
 #ifndef _GCODE_H_
 #define _GCODE_H_
 
+#include <stddef.h>
 #include <math.h>
 
+#include "program.h"
+
 #define GCODE_BLOCKSIZE (256 + 1)
 
 typedef struct {
@@ -15,20 +18,64 @@ float length(const point a);
 
 float angle(const point a, const point b);
 
-typedef struct gcword {
-  char letter;
-  float num;
-} gcword;
-
-typedef struct gcblock {
-  struct gcblock *next;
-  char *text;
-  char optdelete;
-  unsigned line, real_line, index;
-  gcword *words;
-  unsigned wordcnt;
-} gcblock;
-
-gcblock *parse_block(char *buffer, unsigned len);
+/* Parses a plain decimal number ([+-]digits[.digits]) from at most
+ * len characters of buffer, independent of locale.  Returns the number
+ * of characters consumed, or 0 if there is no number, or one of more
+ * than 127 characters that can't be read exactly without them all.
+ * Results are correctly rounded. */
+size_t gc_parse_float(const char *buffer, size_t len, float *result);
+
+/* Parses an unsigned decimal integer as above, returning 0 as well if
+ * it doesn't fit in an unsigned long. */
+size_t gc_parse_uint(const char *buffer, size_t len, unsigned long *result);
+
+/* Parses a single line of gcode and appends it to prog, decoded, with
+ * its real_line zeroed and no source offsets.  Returns 1 if a block was appended, 0
+ * if the line was blank, or -1 if it was malformed (or memory ran
+ * out), in which case prog is unchanged. */
+int parse_block(gcprogram *prog, const char *buffer, size_t len);
+
+/* Decodes the words of prog's last block into instructions, which
+ * there must be room for.  parse_block does this for every block it
+ * appends. */
+void gc_decode_block(gcprogram *prog);
+
+/* Line-by-line parsing state for a whole program.  Blocks are appended
+ * to prog in source order with real_line set to the (1-based) line on
+ * which they appear, and if prog->keepsrc is set, srcoff and srclen set
+ * to where in the input their text lies. */
+typedef struct gcparse {
+  gcprogram *prog;
+  unsigned lines;               /* Newlines seen so far */
+  uint64_t offset;              /* Bytes consumed so far */
+  /* Called for each malformed line; defaults to a warning on stderr,
+   * or to recording it in diag if that's set */
+  void (*malformed)(struct gcparse *parse, unsigned real_line,
+                    const char *text, size_t len);
+  /* Called for each word that decodes to GCOP_UNSUPPORTED; defaults
+   * likewise */
+  void (*unsupported)(struct gcparse *parse, unsigned real_line,
+                      char letter, float num);
+  /* If set, called after each line that is not blank with the result
+   * of parse_block on it.  text is only valid during the call.
+   * Returning nonzero stops gcparse_lines just after that line. */
+  int (*online)(struct gcparse *parse, int result, const char *text,
+                size_t len);
+  struct gcdiag *diag;          /* Collects problems instead of printing */
+  void *data;                   /* For the use of online */
+  char stopped;                 /* Set if online stopped the last call */
+} gcparse;
+
+void gcparse_init(gcparse *parse, gcprogram *prog);
+
+/* Parses every line in buffer terminated by CR or LF.  If final is
+ * set, a trailing unterminated line is parsed as well.  Returns the
+ * number of bytes consumed; anything left over is an incomplete line,
+ * or the lines after the one on which online asked to stop, and should
+ * be presented again later. */
+size_t gcparse_lines(gcparse *parse, const char *buffer, size_t len, int final);
+
+/* Forgets all parsed blocks. */
+void gcparse_reset(gcparse *parse);
 
 #endif
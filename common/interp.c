@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "interp.h"
+
+#define MM_PER_INCH 25.4f
+
+static void initial_state(gcstate *state) {
+  memset(state, 0, sizeof(gcstate));
+  state->lastg = -1;
+}
+
+void gcinterp_init(gcinterp *interp, const gcprogram *prog, unsigned interval) {
+  interp->prog = prog;
+  initial_state(&interp->state);
+  interp->block = 0;
+  interp->snapshots = NULL;
+  interp->snapcnt = interp->snapcap = 0;
+  interp->interval = interval;
+}
+
+void gcinterp_free(gcinterp *interp) {
+  free(interp->snapshots);
+  interp->snapshots = NULL;
+  interp->snapcnt = interp->snapcap = 0;
+}
+
+void gcinterp_reset(gcinterp *interp) {
+  initial_state(&interp->state);
+  interp->block = 0;
+  interp->snapcnt = 0;
+}
+
+/* Applies an axis word, already in mm, according to the G code mode.
+ * Returns nonzero if the tool moved. */
+static int axis(int mode, float *pos, float *offset, char relative,
+                float value) {
+  switch(mode) {
+  case 0:
+  case 1:
+    *pos = (relative ? *pos : *offset) + value;
+    return 1;
+
+  case 28:                      /* Home */
+    *pos = 0;
+    return 1;
+
+  case 92:                      /* Call the current position value */
+    *offset = *pos - value;
+    return 0;
+
+  default:
+    return 0;
+  }
+}
+
+/* Applies an instruction's operands.  Returns GCSTEP_MOVED if the tool
+ * moved. */
+static int operands(gcstate *s, int mode, const gcinsn *insn,
+                    const float *operand) {
+  const float scale = s->inches ? MM_PER_INCH : 1;
+  int moved = 0;
+  operand += insn->operand;
+  if(insn->axes & GCAXIS_X) {
+    moved |= axis(mode, &s->pos.x, &s->offset.x, s->relative, *operand++ * scale);
+  }
+  if(insn->axes & GCAXIS_Y) {
+    moved |= axis(mode, &s->pos.y, &s->offset.y, s->relative, *operand++ * scale);
+  }
+  if(insn->axes & GCAXIS_Z) {
+    moved |= axis(mode, &s->pos.z, &s->offset.z, s->relative, *operand++ * scale);
+  }
+  if(insn->axes & GCAXIS_E) {
+    axis(mode, &s->e, &s->eoffset, s->relative_e, *operand++ * scale);
+  }
+  if(insn->axes & GCAXIS_F) {
+    s->feedrate = *operand * scale;
+  }
+  return moved ? GCSTEP_MOVED : 0;
+}
+
+int gcinterp_step(gcinterp *interp) {
+  const gcprogram *prog = interp->prog;
+  const size_t b = interp->block;
+  if(b >= prog->blockcnt) {
+    return -1;
+  }
+  if(interp->interval && b % interp->interval == 0
+     && b / interp->interval == interp->snapcnt) {
+    /* Out of memory just means seeks replay from an earlier snapshot */
+    if(interp->snapcnt == interp->snapcap) {
+      const size_t cap = interp->snapcap ? 2 * interp->snapcap : 64;
+      gcstate *grown = realloc(interp->snapshots, cap * sizeof(gcstate));
+      if(grown) {
+        interp->snapshots = grown;
+        interp->snapcap = cap;
+      }
+    }
+    if(interp->snapcnt < interp->snapcap) {
+      interp->snapshots[interp->snapcnt++] = interp->state;
+    }
+  }
+  ++interp->block;
+
+  gcstate *s = &interp->state;
+  int flags = 0;
+  size_t i;
+  for(i = prog->insnidx[b]; i < prog->insnidx[b + 1]; ++i) {
+    const gcinsn *insn = &prog->insns[i];
+    switch(insn->op) {
+    case GCOP_AXES:
+      flags |= operands(s, s->lastg, insn, prog->operands);
+      break;
+
+    case GCOP_RAPID:
+    case GCOP_LINEAR:
+      s->lastg = insn->code;
+      flags |= GCSTEP_MOTION | operands(s, s->lastg, insn, prog->operands);
+      break;
+
+    case GCOP_HOME:
+      s->lastg = insn->code;
+      if(insn->axes & (GCAXIS_X | GCAXIS_Y | GCAXIS_Z)) {
+        flags |= operands(s, s->lastg, insn, prog->operands);
+      } else {
+        /* Home everything */
+        s->pos.x = s->pos.y = s->pos.z = 0;
+        flags |= GCSTEP_MOVED;
+      }
+      break;
+
+    case GCOP_SET_POS:
+      s->lastg = insn->code;
+      if(insn->axes & (GCAXIS_X | GCAXIS_Y | GCAXIS_Z | GCAXIS_E)) {
+        operands(s, s->lastg, insn, prog->operands);
+      } else {
+        /* Zero everything */
+        s->offset = s->pos;
+        s->eoffset = s->e;
+      }
+      break;
+
+    case GCOP_DWELL:
+      s->lastg = insn->code;
+      break;
+
+    case GCOP_INCHES:
+      s->lastg = insn->code;
+      s->inches = 1;
+      break;
+    case GCOP_MM:
+      s->lastg = insn->code;
+      s->inches = 0;
+      break;
+
+    case GCOP_SET_ABS:
+      s->lastg = insn->code;
+      s->relative = 0;
+      s->relative_e = 0;
+      break;
+    case GCOP_SET_REL:
+      s->lastg = insn->code;
+      s->relative = 1;
+      s->relative_e = 1;
+      break;
+
+    case GCOP_EXTRUDER_ON:
+      s->extruding = 1;
+      break;
+    case GCOP_EXTRUDER_OFF:
+    case GCOP_EXTRUDER_REVERSE:
+      s->extruding = 0;
+      break;
+
+    case GCOP_E_ABS:
+      s->relative_e = 0;
+      break;
+    case GCOP_E_REL:
+      s->relative_e = 1;
+      break;
+
+    case GCOP_UNSUPPORTED:
+      /* Axis words still belong to an unsupported G code */
+      if(insn->code == 'G') {
+        s->lastg = (int)prog->nums[insn->operand];
+      }
+      break;
+
+    default:
+      break;
+    }
+  }
+  return flags;
+}
+
+void gcinterp_seek(gcinterp *interp, size_t block) {
+  if(interp->snapcnt) {
+    size_t snap = block / interp->interval;
+    if(snap >= interp->snapcnt) {
+      snap = interp->snapcnt - 1;
+    }
+    /* Only go back to a snapshot if it saves replaying anything */
+    const size_t start = snap * interp->interval;
+    if(block < interp->block || start > interp->block) {
+      interp->state = interp->snapshots[snap];
+      interp->block = start;
+    }
+  } else if(block < interp->block) {
+    initial_state(&interp->state);
+    interp->block = 0;
+  }
+
+  while(interp->block < block && gcinterp_step(interp) >= 0);
+}
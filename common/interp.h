@@ -0,0 +1,59 @@
+#ifndef _INTERP_H_
+#define _INTERP_H_
+
+#include <stddef.h>
+
+#include "gcode.h"
+
+/* Default number of blocks between snapshots. */
+#define GCINTERP_INTERVAL 4096
+
+/* Modal machine state.  Everything is kept in mm, whatever units the
+ * program uses. */
+typedef struct gcstate {
+  point pos;                    /* Tool position */
+  point offset;                 /* Where G92 put the origin */
+  float e, eoffset;             /* Extruder axis, likewise */
+  float feedrate;               /* mm/min */
+  int lastg;                    /* Axis words are interpreted by this */
+  char relative;                /* G91 */
+  char relative_e;              /* M83, or G91 */
+  char inches;                  /* G20 */
+  char extruding;               /* M101 */
+} gcstate;
+
+/* What executing a block did */
+#define GCSTEP_MOVED 0x1        /* An axis was moved or homed */
+#define GCSTEP_MOTION 0x2       /* The block held a G0 or G1 */
+
+/* Steps through a program's decoded blocks in order, keeping machine
+ * state.  Every interval blocks a copy of the state is kept, so that
+ * gcinterp_seek can start anywhere by replaying fewer than interval
+ * blocks.  Unsupported words are skipped silently, having been reported
+ * when they were parsed. */
+typedef struct gcinterp {
+  const gcprogram *prog;
+  gcstate state;                /* Before block */
+  size_t block;                 /* Next block to run */
+  gcstate *snapshots;           /* State before block i * interval */
+  size_t snapcnt, snapcap;
+  unsigned interval;            /* 0 disables snapshots */
+} gcinterp;
+
+void gcinterp_init(gcinterp *interp, const gcprogram *prog, unsigned interval);
+
+void gcinterp_free(gcinterp *interp);
+
+/* Returns to the start of the program and forgets all snapshots, e.g.
+ * after the program is reset. */
+void gcinterp_reset(gcinterp *interp);
+
+/* Runs the next block.  Returns a combination of the GCSTEP_ flags, or
+ * -1 if there are no blocks left. */
+int gcinterp_step(gcinterp *interp);
+
+/* Moves to just before block, restoring the nearest snapshot at or
+ * before it and replaying from there. */
+void gcinterp_seek(gcinterp *interp, size_t block);
+
+#endif
@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "parallel.h"
+#include "scan.h"
+
+typedef struct badline {
+  unsigned real_line;           /* Relative to the start of the chunk */
+  const char *text;             /* Malformed line, or */
+  size_t len;
+  char letter;                  /* unsupported word */
+  float num;
+} badline;
+
+typedef struct worker {
+  gcparse parse;                /* Must be first; see record_malformed */
+  gcprogram prog;
+  const char *start;
+  size_t len;
+  gcprogram *dst;
+  gcextent at;                  /* Where this chunk goes in dst */
+  unsigned lineoff;
+  uint64_t byteoff;
+  badline *bad;
+  size_t badcnt, badcap;
+} worker;
+
+/* Returns NULL if out of memory, in which case the problem goes
+ * unreported. */
+static badline *add_badline(worker *w, unsigned real_line) {
+  if(w->badcnt == w->badcap) {
+    const size_t cap = w->badcap ? 2 * w->badcap : 16;
+    badline *grown = realloc(w->bad, cap * sizeof(badline));
+    if(!grown) {
+      return NULL;
+    }
+    w->bad = grown;
+    w->badcap = cap;
+  }
+  badline *bad = &w->bad[w->badcnt++];
+  memset(bad, 0, sizeof(badline));
+  bad->real_line = real_line;
+  return bad;
+}
+
+/* Problems are reported after stitching so that they come out in order
+ * and with correct line numbers. */
+static void record_malformed(gcparse *parse, unsigned real_line,
+                             const char *text, size_t len) {
+  badline *bad = add_badline((worker*)parse, real_line);
+  if(!bad) {
+    return;
+  }
+  bad->text = text;
+  bad->len = len;
+}
+
+static void record_unsupported(gcparse *parse, unsigned real_line,
+                               char letter, float num) {
+  badline *bad = add_badline((worker*)parse, real_line);
+  if(!bad) {
+    return;
+  }
+  bad->letter = letter;
+  bad->num = num;
+}
+
+static void *parse_chunk(void *arg) {
+  worker *w = arg;
+  gcparse_lines(&w->parse, w->start, w->len, 1);
+  return NULL;
+}
+
+static void *copy_chunk(void *arg) {
+  worker *w = arg;
+  gcprogram_copy_into(w->dst, &w->at, &w->prog, w->lineoff, w->byteoff);
+  return NULL;
+}
+
+/* Runs fn on every worker, using the calling thread for the first.
+ * Returns -1 without running anything if out of memory. */
+static int run_workers(worker *workers, unsigned count, void *(*fn)(void*)) {
+  pthread_t *threads = malloc(count * sizeof(pthread_t));
+  char *started = calloc(count, sizeof(char));
+  if(!threads || !started) {
+    free(threads);
+    free(started);
+    return -1;
+  }
+  unsigned i;
+  for(i = 1; i < count; ++i) {
+    started[i] = (pthread_create(&threads[i], NULL, fn, &workers[i]) == 0);
+  }
+  fn(&workers[0]);
+  for(i = 1; i < count; ++i) {
+    if(started[i]) {
+      pthread_join(threads[i], NULL);
+    } else {
+      fn(&workers[i]);
+    }
+  }
+  free(started);
+  free(threads);
+  return 0;
+}
+
+/* Frees every worker's parse of its chunk, and the workers. */
+static void free_workers(worker *workers, unsigned count) {
+  unsigned i;
+  for(i = 0; i < count; ++i) {
+    free(workers[i].bad);
+    gcprogram_free(&workers[i].prog);
+  }
+  free(workers);
+}
+
+int gcparse_parallel(gcparse *parse, const char *buffer, size_t len,
+                     unsigned threads) {
+  if(threads == 0) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? cpus : 1;
+  }
+  if(threads > len / GCPARALLEL_MINCHUNK) {
+    threads = len / GCPARALLEL_MINCHUNK;
+  }
+  if(threads <= 1 || parse->online) {
+    gcparse_lines(parse, buffer, len, 1);
+    return 0;
+  }
+
+  /* Split just after a newline near each even division */
+  worker *workers = calloc(threads, sizeof(worker));
+  if(!workers) {
+    errno = ENOMEM;
+    return -1;
+  }
+  unsigned count = 0;
+  size_t start = 0;
+  while(count < threads && start < len) {
+    size_t end = (count == threads - 1) ? len : (len / threads) * (count + 1);
+    if(end < start) {
+      end = start;
+    }
+    if(end < len) {
+      end += gc_find_byte(buffer + end, len - end, '\n');
+      if(end < len) {
+        ++end;
+      }
+    }
+
+    worker *w = &workers[count++];
+    gcprogram_init(&w->prog);
+    w->prog.keepsrc = parse->prog->keepsrc;
+    gcparse_init(&w->parse, &w->prog);
+    w->parse.malformed = &record_malformed;
+    w->parse.unsupported = &record_unsupported;
+    w->start = buffer + start;
+    w->len = end - start;
+    start = end;
+  }
+
+  if(run_workers(workers, count, &parse_chunk) < 0) {
+    free_workers(workers, count);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  /* Each chunk's numbering continues from the ones before it */
+  gcprogram *prog = parse->prog;
+  unsigned i;
+  unsigned lines = parse->lines;
+  gcextent end = {prog->blockcnt, prog->wordcnt, prog->insncnt, prog->opercnt};
+  for(i = 0; i < count; ++i) {
+    worker *w = &workers[i];
+    w->dst = prog;
+    w->lineoff = lines;
+    w->byteoff = parse->offset + (w->start - buffer);
+    w->at = end;
+    lines += w->parse.lines;
+    end.blocks += w->prog.blockcnt;
+    end.words += w->prog.wordcnt;
+    end.insns += w->prog.insncnt;
+    end.operands += w->prog.opercnt;
+  }
+
+  /* Stitch, or leave everything as it was if there's no room to */
+  if(gcprogram_reserve(prog, end.blocks - prog->blockcnt, end.words - prog->wordcnt) < 0
+     || run_workers(workers, count, &copy_chunk) < 0) {
+    free_workers(workers, count);
+    errno = ENOMEM;
+    return -1;
+  }
+  prog->blockcnt = end.blocks;
+  prog->wordcnt = end.words;
+  prog->insncnt = end.insns;
+  prog->opercnt = end.operands;
+  parse->lines = lines;
+  parse->offset += len;
+  for(i = 0; i < count; ++i) {
+    worker *w = &workers[i];
+    size_t b;
+    for(b = 0; b < w->badcnt; ++b) {
+      const badline *bad = &w->bad[b];
+      if(bad->text) {
+        parse->malformed(parse, bad->real_line + w->lineoff, bad->text, bad->len);
+      } else {
+        parse->unsupported(parse, bad->real_line + w->lineoff, bad->letter, bad->num);
+      }
+    }
+  }
+  free_workers(workers, count);
+  return 0;
+}
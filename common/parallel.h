@@ -0,0 +1,20 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include "gcode.h"
+
+/* Inputs smaller than this per thread aren't worth splitting. */
+#define GCPARALLEL_MINCHUNK (1024 * 1024)
+
+/* Equivalent to gcparse_lines(parse, buffer, len, 1), but splits buffer
+ * at line boundaries and parses the pieces on up to threads threads (or
+ * one per online CPU if threads is 0).  The resulting blocks, their
+ * numbering and any malformed-line reports are identical to the serial
+ * path.  If parse has an online callback the whole buffer is parsed
+ * serially, since that must see lines in order.  Returns 0, or -1 with
+ * errno set if out of memory, in which case parse is unchanged and
+ * nothing is reported. */
+int gcparse_parallel(gcparse *parse, const char *buffer, size_t len,
+                     unsigned threads);
+
+#endif
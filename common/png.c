@@ -0,0 +1,161 @@
+#include "png.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/* Most bytes in a stored deflate block */
+#define STORED_MAX 65535
+
+#ifndef HAVE_ZLIB
+/* A bit at a time; the data's stored, so there's no inflating to time
+ * this against */
+static uint32_t crc32(uint32_t crc, const unsigned char *data, size_t len) {
+  crc = ~crc;
+  size_t i;
+  int k;
+  for(i = 0; i < len; ++i) {
+    crc ^= data[i];
+    for(k = 0; k < 8; ++k) {
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+static uint32_t adler32(const unsigned char *data, size_t len) {
+  uint32_t a = 1, b = 0;
+  size_t i;
+  for(i = 0; i < len; ++i) {
+    a = (a + data[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  return (b << 16) | a;
+}
+#endif
+
+static void put32(unsigned char *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+/* Writes a chunk of the given type.  Returns -1 on failure. */
+static int chunk(FILE *out, const char *type, const unsigned char *data,
+                 size_t len) {
+  unsigned char head[8], tail[4];
+  put32(head, len);
+  memcpy(head + 4, type, 4);
+  uint32_t crc = crc32(0, head + 4, 4);
+  if(len) {
+    crc = crc32(crc, data, len);
+  }
+  put32(tail, crc);
+  if(fwrite(head, 1, 8, out) != 8
+     || (len && fwrite(data, 1, len, out) != len)
+     || fwrite(tail, 1, 4, out) != 4) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Wraps raw in a zlib stream.  Returns NULL if memory ran out. */
+static unsigned char *deflate_raw(const unsigned char *raw, size_t len,
+                                  size_t *outlen) {
+#ifdef HAVE_ZLIB
+  uLongf n = compressBound(len);
+  unsigned char *z = malloc(n);
+  if(!z) {
+    return NULL;
+  }
+  if(compress2(z, &n, raw, len, Z_BEST_SPEED) != Z_OK) {
+    free(z);
+    errno = ENOMEM;
+    return NULL;
+  }
+  *outlen = n;
+  return z;
+#else
+  const size_t blocks = len ? (len + STORED_MAX - 1) / STORED_MAX : 1;
+  unsigned char *z = malloc(2 + blocks * 5 + len + 4);
+  if(!z) {
+    return NULL;
+  }
+  unsigned char *p = z;
+  *p++ = 0x78;                  /* 32K window, deflate */
+  *p++ = 0x01;                  /* No preset dictionary, checks out */
+  size_t off = 0;
+  do {
+    const size_t n = len - off < STORED_MAX ? len - off : STORED_MAX;
+    *p++ = off + n == len;      /* Final or not, stored */
+    *p++ = n;
+    *p++ = n >> 8;
+    *p++ = ~n;
+    *p++ = ~n >> 8;
+    memcpy(p, raw + off, n);
+    p += n;
+    off += n;
+  } while(off < len);
+  put32(p, adler32(raw, len));
+  p += 4;
+  *outlen = p - z;
+  return z;
+#endif
+}
+
+int gcpng_write(const char *path, const unsigned char *rgb,
+                unsigned width, unsigned height) {
+  static const unsigned char signature[8] = {
+    0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+  };
+  /* Each row starts with its filter, none */
+  const size_t stride = (size_t)width * 3;
+  const size_t rawlen = (stride + 1) * height;
+  unsigned char *raw = malloc(rawlen ? rawlen : 1);
+  if(!raw) {
+    return -1;
+  }
+  unsigned y;
+  for(y = 0; y < height; ++y) {
+    raw[y * (stride + 1)] = 0;
+    memcpy(raw + y * (stride + 1) + 1, rgb + y * stride, stride);
+  }
+  size_t zlen;
+  unsigned char *z = deflate_raw(raw, rawlen, &zlen);
+  free(raw);
+  if(!z) {
+    return -1;
+  }
+
+  unsigned char ihdr[13];
+  put32(ihdr, width);
+  put32(ihdr + 4, height);
+  ihdr[8] = 8;                  /* Bits per channel */
+  ihdr[9] = 2;                  /* RGB */
+  ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+  FILE *out = fopen(path, "wb");
+  if(!out) {
+    free(z);
+    return -1;
+  }
+  int result = 0;
+  if(fwrite(signature, 1, sizeof(signature), out) != sizeof(signature)
+     || chunk(out, "IHDR", ihdr, sizeof(ihdr)) < 0
+     || chunk(out, "IDAT", z, zlen) < 0
+     || chunk(out, "IEND", NULL, 0) < 0) {
+    result = -1;
+  }
+  free(z);
+  if(fclose(out) != 0) {
+    result = -1;
+  }
+  return result;
+}
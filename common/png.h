@@ -0,0 +1,12 @@
+#ifndef _PNG_H_
+#define _PNG_H_
+
+#include <stddef.h>
+
+/* Writes width by height 8-bit RGB pixels, row by row from the top, to
+ * a PNG file at path.  Without zlib the image data is stored rather
+ * than compressed.  Returns -1 with errno set on failure. */
+int gcpng_write(const char *path, const unsigned char *rgb,
+                unsigned width, unsigned height);
+
+#endif
@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "program.h"
+
+#ifdef UNIX
+#include <sys/mman.h>
+#endif
+
+void gcprogram_init(gcprogram *prog) {
+  memset(prog, 0, sizeof(gcprogram));
+}
+
+void gcprogram_free(gcprogram *prog) {
+  if(prog->mapping) {
+#ifdef UNIX
+    munmap(prog->mapping, prog->mappinglen);
+#endif
+  } else {
+    free(prog->letters);
+    free(prog->nums);
+    free(prog->wordidx);
+    free(prog->line);
+    free(prog->real_line);
+    free(prog->optdelete);
+    free(prog->srcoff);
+    free(prog->srclen);
+  }
+  /* Never mapped */
+  free(prog->insns);
+  free(prog->operands);
+  free(prog->insnidx);
+  const char keepsrc = prog->keepsrc;
+  gcprogram_init(prog);
+  prog->keepsrc = keepsrc;
+}
+
+void gcprogram_reset(gcprogram *prog) {
+  prog->wordcnt = 0;
+  prog->insncnt = 0;
+  prog->opercnt = 0;
+  prog->blockcnt = 0;
+}
+
+static int grow(void **array, size_t count, size_t size) {
+  void *grown = realloc(*array, count * size);
+  if(!grown) {
+    return -1;
+  }
+  *array = grown;
+  return 0;
+}
+
+static void *heapcopy(const void *data, size_t size) {
+  void *copy = malloc(size ? size : 1);
+  if(copy) {
+    memcpy(copy, data, size);
+  }
+  return copy;
+}
+
+/* Moves a mapped program's arrays to the heap so they can grow.  The
+ * decoded ones are there already, and are handed over as they are. */
+static int unshare(gcprogram *prog) {
+  gcprogram copy = *prog;
+  copy.insns = NULL;
+  copy.operands = NULL;
+  copy.insnidx = NULL;
+  copy.letters = heapcopy(prog->letters, prog->wordcnt);
+  copy.nums = heapcopy(prog->nums, prog->wordcnt * sizeof(float));
+  copy.wordidx = heapcopy(prog->wordidx, (prog->blockcnt + 1) * sizeof(unsigned));
+  copy.line = heapcopy(prog->line, prog->blockcnt * sizeof(unsigned));
+  copy.real_line = heapcopy(prog->real_line, prog->blockcnt * sizeof(unsigned));
+  copy.optdelete = heapcopy(prog->optdelete, prog->blockcnt);
+  copy.srcoff = prog->srcoff ? heapcopy(prog->srcoff, prog->blockcnt * sizeof(uint64_t)) : NULL;
+  copy.srclen = prog->srclen ? heapcopy(prog->srclen, prog->blockcnt * sizeof(unsigned)) : NULL;
+  copy.mapping = NULL;
+  copy.mappinglen = 0;
+  if(!copy.letters || !copy.nums || !copy.wordidx || !copy.line
+     || !copy.real_line || !copy.optdelete
+     || (prog->srcoff && !copy.srcoff) || (prog->srclen && !copy.srclen)) {
+    gcprogram_free(&copy);
+    return -1;
+  }
+  copy.wordcap = prog->wordcnt;
+  copy.blockcap = prog->blockcnt;
+  copy.insns = prog->insns;
+  copy.operands = prog->operands;
+  copy.insnidx = prog->insnidx;
+  prog->insns = NULL;
+  prog->operands = NULL;
+  prog->insnidx = NULL;
+  gcprogram_free(prog);
+  *prog = copy;
+  return 0;
+}
+
+int gcprogram_reserve(gcprogram *prog, size_t blocks, size_t words) {
+  if(prog->mapping && unshare(prog) < 0) {
+    return -1;
+  }
+  if(prog->wordcnt + words > prog->wordcap) {
+    size_t cap = prog->wordcap ? prog->wordcap : 1024;
+    while(cap < prog->wordcnt + words) {
+      cap *= 2;
+    }
+    if(grow((void**)&prog->letters, cap, sizeof(char)) < 0
+       || grow((void**)&prog->nums, cap, sizeof(float)) < 0) {
+      return -1;
+    }
+    prog->wordcap = cap;
+  }
+
+  /* Each word becomes at most one instruction or operand, and each
+   * block may add a GCOP_AXES */
+  if(prog->insncnt + words + blocks > prog->insncap) {
+    size_t cap = prog->insncap ? prog->insncap : 1024;
+    while(cap < prog->insncnt + words + blocks) {
+      cap *= 2;
+    }
+    if(grow((void**)&prog->insns, cap, sizeof(gcinsn)) < 0) {
+      return -1;
+    }
+    prog->insncap = cap;
+  }
+  if(prog->opercnt + words > prog->opercap) {
+    size_t cap = prog->opercap ? prog->opercap : 1024;
+    while(cap < prog->opercnt + words) {
+      cap *= 2;
+    }
+    if(grow((void**)&prog->operands, cap, sizeof(float)) < 0) {
+      return -1;
+    }
+    prog->opercap = cap;
+  }
+
+  if(prog->blockcnt + blocks > prog->blockcap
+     || (prog->keepsrc && !prog->srcoff)) {
+    size_t cap = prog->blockcap ? prog->blockcap : 256;
+    while(cap < prog->blockcnt + blocks) {
+      cap *= 2;
+    }
+    const char hadsrc = (prog->srcoff != NULL);
+    if(grow((void**)&prog->wordidx, cap + 1, sizeof(unsigned)) < 0
+       || grow((void**)&prog->insnidx, cap + 1, sizeof(unsigned)) < 0
+       || grow((void**)&prog->line, cap, sizeof(unsigned)) < 0
+       || grow((void**)&prog->real_line, cap, sizeof(unsigned)) < 0
+       || grow((void**)&prog->optdelete, cap, sizeof(char)) < 0
+       || (prog->keepsrc && (grow((void**)&prog->srcoff, cap, sizeof(uint64_t)) < 0
+                             || grow((void**)&prog->srclen, cap, sizeof(unsigned)) < 0))) {
+      return -1;
+    }
+    if(prog->blockcap == 0) {
+      prog->wordidx[0] = 0;
+      prog->insnidx[0] = 0;
+    }
+    if(prog->keepsrc && !hadsrc) {
+      /* Offsets were only just asked for */
+      memset(prog->srcoff, 0, prog->blockcnt * sizeof(uint64_t));
+      memset(prog->srclen, 0, prog->blockcnt * sizeof(unsigned));
+    }
+    prog->blockcap = cap;
+  }
+  return 0;
+}
+
+void gcprogram_copy_into(gcprogram *dst, const gcextent *at,
+                         const gcprogram *src, unsigned lineoff,
+                         uint64_t byteoff) {
+  const size_t first = at->blocks;
+  memcpy(dst->letters + at->words, src->letters, src->wordcnt);
+  memcpy(dst->nums + at->words, src->nums, src->wordcnt * sizeof(float));
+  memcpy(dst->operands + at->operands, src->operands, src->opercnt * sizeof(float));
+  memcpy(dst->line + first, src->line, src->blockcnt * sizeof(unsigned));
+  memcpy(dst->optdelete + first, src->optdelete, src->blockcnt);
+  size_t b, i;
+  for(i = 0; i < src->insncnt; ++i) {
+    gcinsn insn = src->insns[i];
+    insn.operand += (insn.op == GCOP_UNSUPPORTED) ? at->words : at->operands;
+    dst->insns[at->insns + i] = insn;
+  }
+  for(b = 0; b < src->blockcnt; ++b) {
+    dst->wordidx[first + b + 1] = at->words + src->wordidx[b + 1];
+    dst->insnidx[first + b + 1] = at->insns + src->insnidx[b + 1];
+    dst->real_line[first + b] = src->real_line[b] + lineoff;
+  }
+  if(dst->keepsrc) {
+    if(src->srcoff) {
+      for(b = 0; b < src->blockcnt; ++b) {
+        dst->srcoff[first + b] = src->srcoff[b] + byteoff;
+      }
+      memcpy(dst->srclen + first, src->srclen, src->blockcnt * sizeof(unsigned));
+    } else {
+      memset(dst->srcoff + first, 0, src->blockcnt * sizeof(uint64_t));
+      memset(dst->srclen + first, 0, src->blockcnt * sizeof(unsigned));
+    }
+  }
+}
+
+int gcprogram_append(gcprogram *dst, const gcprogram *src, unsigned lineoff,
+                     uint64_t byteoff) {
+  if(gcprogram_reserve(dst, src->blockcnt, src->wordcnt) < 0) {
+    return -1;
+  }
+  const gcextent at = {dst->blockcnt, dst->wordcnt, dst->insncnt, dst->opercnt};
+  gcprogram_copy_into(dst, &at, src, lineoff, byteoff);
+  dst->blockcnt += src->blockcnt;
+  dst->wordcnt += src->wordcnt;
+  dst->insncnt += src->insncnt;
+  dst->opercnt += src->opercnt;
+  return 0;
+}
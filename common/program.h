@@ -0,0 +1,142 @@
+#ifndef _PROGRAM_H_
+#define _PROGRAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Instruction opcodes.  Each G or M code a block holds becomes one
+ * instruction; the axis words of the block become operands of its last
+ * motion-like instruction (G0, G1, G28 or G92), or of a GCOP_AXES if
+ * there is none, to be interpreted according to the last G code. */
+enum {
+  GCOP_AXES,                    /* Axis words alone */
+  GCOP_RAPID,                   /* G0 */
+  GCOP_LINEAR,                  /* G1 */
+  GCOP_DWELL,                   /* G4 */
+  GCOP_INCHES,                  /* G20 */
+  GCOP_MM,                      /* G21 */
+  GCOP_HOME,                    /* G28 */
+  GCOP_SET_ABS,                 /* G90 */
+  GCOP_SET_REL,                 /* G91 */
+  GCOP_SET_POS,                 /* G92 */
+  GCOP_EXTRUDER_ON,             /* M101 */
+  GCOP_EXTRUDER_OFF,            /* M102 */
+  GCOP_EXTRUDER_REVERSE,        /* M103 */
+  GCOP_E_ABS,                   /* M82 */
+  GCOP_E_REL,                   /* M83 */
+  GCOP_UNSUPPORTED              /* A word we don't understand */
+};
+
+/* Operand presence bits.  Operands are stored in this order, one for
+ * each bit set. */
+#define GCAXIS_X 0x01
+#define GCAXIS_Y 0x02
+#define GCAXIS_Z 0x04
+#define GCAXIS_E 0x08
+#define GCAXIS_F 0x10
+
+typedef struct gcinsn {
+  unsigned char op;             /* GCOP_ */
+  unsigned char axes;           /* GCAXIS_ bits */
+  unsigned short code;          /* G/M number, or the letter if unsupported */
+  unsigned operand;             /* First operand, or the word if unsupported */
+} gcinsn;
+
+/* A parsed gcode program, stored as flat arrays rather than a list of
+ * blocks.  The words of all blocks are stored back to back; block b
+ * owns words wordidx[b] up to (but excluding) wordidx[b + 1].  Blocks
+ * are numbered from 0 here, and from 1 in user-facing messages. */
+typedef struct gcprogram {
+  char *letters;                /* Upper case */
+  float *nums;
+  size_t wordcnt, wordcap;
+
+  /* Decoded form of the words; block b's instructions are insnidx[b]
+   * up to insnidx[b + 1]. */
+  gcinsn *insns;
+  size_t insncnt, insncap;
+  float *operands;
+  size_t opercnt, opercap;
+
+  unsigned *wordidx;            /* blockcnt + 1 entries */
+  unsigned *insnidx;            /* Likewise */
+  unsigned *line;               /* N word, or 0 */
+  unsigned *real_line;          /* Source line, from 1 */
+  char *optdelete;
+  uint64_t *srcoff;             /* Only allocated if keepsrc is set */
+  unsigned *srclen;
+  size_t blockcnt, blockcap;
+
+  char keepsrc;                 /* Record where each block came from */
+
+  /* Set if the arrays point into a mapped file (see gcbin_load); they
+   * are copied to the heap before the program grows.  The decoded
+   * arrays are always on the heap. */
+  void *mapping;
+  size_t mappinglen;
+} gcprogram;
+
+void gcprogram_init(gcprogram *prog);
+
+void gcprogram_free(gcprogram *prog);
+
+/* Forgets all blocks in O(1), keeping the storage for reuse. */
+void gcprogram_reset(gcprogram *prog);
+
+/* Ensures room for at least blocks more blocks and words more words,
+ * along with their instructions.  Returns 0 on success or -1 if out of
+ * memory. */
+int gcprogram_reserve(gcprogram *prog, size_t blocks, size_t words);
+
+/* A position in each of a program's arrays */
+typedef struct gcextent {
+  size_t blocks, words, insns, operands;
+} gcextent;
+
+/* Copies every block of src into dst, which must already have room,
+ * starting at the positions in at, adding lineoff to each real_line and
+ * byteoff to each srcoff.  dst's counts are not updated.  Distinct
+ * ranges of dst may be filled concurrently. */
+void gcprogram_copy_into(gcprogram *dst, const gcextent *at,
+                         const gcprogram *src, unsigned lineoff,
+                         uint64_t byteoff);
+
+/* Appends a copy of every block of src to dst. */
+int gcprogram_append(gcprogram *dst, const gcprogram *src, unsigned lineoff,
+                     uint64_t byteoff);
+
+/* Linear traversal of a program's blocks:
+ *
+ *   gciter it;
+ *   gciter_init(&it, prog, 0);
+ *   while(gciter_next(&it)) {
+ *     for(w = it.word; w < it.end; ++w) { ... prog->letters[w] ... }
+ *   }
+ */
+typedef struct gciter {
+  const gcprogram *prog;
+  size_t block;                 /* Current block */
+  size_t word, end;             /* Current block's words */
+  size_t next;
+} gciter;
+
+/* Prepares to visit blocks from first onwards. */
+static inline void gciter_init(gciter *it, const gcprogram *prog, size_t first) {
+  it->prog = prog;
+  it->next = first;
+  it->block = first;
+  it->word = it->end = 0;
+}
+
+/* Moves to the next block, returning 0 when there are none left. */
+static inline int gciter_next(gciter *it) {
+  if(it->next >= it->prog->blockcnt) {
+    return 0;
+  }
+  it->block = it->next++;
+  it->word = it->prog->wordidx[it->block];
+  it->end = it->prog->wordidx[it->block + 1];
+  return 1;
+}
+
+#endif
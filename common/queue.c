@@ -0,0 +1,44 @@
+#include "queue.h"
+
+#include <stdlib.h>
+
+int gcqueue_init(gcqueue *queue, size_t cap) {
+  size_t slots = 1;
+  while(slots < cap) {
+    slots *= 2;
+  }
+  queue->slots = malloc(slots * sizeof(void*));
+  if(!queue->slots) {
+    return -1;
+  }
+  queue->mask = slots - 1;
+  queue->tail = queue->head = 0;
+  return 0;
+}
+
+void gcqueue_free(gcqueue *queue) {
+  free(queue->slots);
+  queue->slots = NULL;
+}
+
+int gcqueue_push(gcqueue *queue, void *item) {
+  const size_t tail = queue->tail;
+  /* The consumer must be done with a slot before it's reused */
+  if(tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) > queue->mask) {
+    return -1;
+  }
+  queue->slots[tail & queue->mask] = item;
+  /* Publishes the item along with whatever it points to */
+  __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void *gcqueue_pop(gcqueue *queue) {
+  const size_t head = queue->head;
+  if(head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  void *item = queue->slots[head & queue->mask];
+  __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+  return item;
+}
@@ -0,0 +1,34 @@
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include <stddef.h>
+
+/* Assumed size of a cache line, kept between the two ends */
+#define GCQUEUE_LINE 64
+
+/* A bounded queue of pointers between exactly one producing thread and
+ * one consuming thread, which never lock or wait for each other: each
+ * end only ever writes its own index, and reads the other's. */
+typedef struct gcqueue {
+  void **slots;
+  size_t mask;                  /* Slots - 1; slots is a power of two */
+  /* Items ever pushed, written only by the producer */
+  size_t tail;
+  char pad[GCQUEUE_LINE - sizeof(size_t)];
+  /* Items ever popped, written only by the consumer */
+  size_t head;
+} gcqueue;
+
+/* Makes room for at least cap items.  Returns -1 on failure. */
+int gcqueue_init(gcqueue *queue, size_t cap);
+
+/* Frees the slots, but not anything still queued. */
+void gcqueue_free(gcqueue *queue);
+
+/* Producer only.  Returns -1 if the queue is full. */
+int gcqueue_push(gcqueue *queue, void *item);
+
+/* Consumer only.  Returns NULL if the queue is empty. */
+void *gcqueue_pop(gcqueue *queue);
+
+#endif
@@ -0,0 +1,101 @@
+#include "scan.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define ISSPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+#if defined(__AVX2__)
+
+#define VECSIZE 32
+typedef __m256i vec;
+#define VLOAD(p) _mm256_loadu_si256((const __m256i*)(p))
+#define VSPLAT(c) _mm256_set1_epi8(c)
+#define VEQ(a, b) _mm256_cmpeq_epi8(a, b)
+#define VOR(a, b) _mm256_or_si256(a, b)
+#define VMASK(v) ((unsigned)_mm256_movemask_epi8(v))
+#define ALLBITS 0xFFFFFFFFu
+
+#elif defined(__SSE2__)
+
+#define VECSIZE 16
+typedef __m128i vec;
+#define VLOAD(p) _mm_loadu_si128((const __m128i*)(p))
+#define VSPLAT(c) _mm_set1_epi8(c)
+#define VEQ(a, b) _mm_cmpeq_epi8(a, b)
+#define VOR(a, b) _mm_or_si128(a, b)
+#define VMASK(v) ((unsigned)_mm_movemask_epi8(v))
+#define ALLBITS 0xFFFFu
+
+#endif
+
+size_t gc_find_eol(const char *buffer, size_t len) {
+  size_t i = 0;
+#ifdef VECSIZE
+  const vec lf = VSPLAT('\n'), cr = VSPLAT('\r');
+  for(; i + VECSIZE <= len; i += VECSIZE) {
+    const vec v = VLOAD(buffer + i);
+    const unsigned mask = VMASK(VOR(VEQ(v, lf), VEQ(v, cr)));
+    if(mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for(; i < len; ++i) {
+    if(buffer[i] == '\n' || buffer[i] == '\r') {
+      return i;
+    }
+  }
+  return len;
+}
+
+size_t gc_find_byte(const char *buffer, size_t len, char c) {
+  size_t i = 0;
+#ifdef VECSIZE
+  const vec needle = VSPLAT(c);
+  for(; i + VECSIZE <= len; i += VECSIZE) {
+    const unsigned mask = VMASK(VEQ(VLOAD(buffer + i), needle));
+    if(mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for(; i < len; ++i) {
+    if(buffer[i] == c) {
+      return i;
+    }
+  }
+  return len;
+}
+
+size_t gc_skip_space(const char *buffer, size_t len, size_t i) {
+  /* Whitespace runs between words are usually a single character, so
+   * check a couple of bytes before paying for vector setup. */
+  if(i < len && !ISSPACE(buffer[i])) {
+    return i;
+  }
+  if(++i < len && !ISSPACE(buffer[i])) {
+    return i;
+  }
+#ifdef VECSIZE
+  const vec sp = VSPLAT(' '), tab = VSPLAT('\t');
+  const vec lf = VSPLAT('\n'), cr = VSPLAT('\r');
+  for(; i + VECSIZE <= len; i += VECSIZE) {
+    const vec v = VLOAD(buffer + i);
+    const unsigned mask = VMASK(VOR(VOR(VEQ(v, sp), VEQ(v, tab)),
+                                    VOR(VEQ(v, lf), VEQ(v, cr))));
+    if(mask != ALLBITS) {
+      return i + __builtin_ctz(~mask);
+    }
+  }
+#endif
+  for(; i < len; ++i) {
+    if(!ISSPACE(buffer[i])) {
+      return i;
+    }
+  }
+  return len;
+}
@@ -0,0 +1,22 @@
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <stddef.h>
+
+/* Byte scanning kernels shared by everything that tokenizes gcode.
+ * These use AVX2 or SSE2 when the compiler targets them, and plain
+ * loops otherwise. */
+
+/* Returns the offset of the first '\n' or '\r' in buffer, or len if
+ * there is none. */
+size_t gc_find_eol(const char *buffer, size_t len);
+
+/* Returns the offset of the first occurrence of c in buffer, or len
+ * if there is none. */
+size_t gc_find_byte(const char *buffer, size_t len, char c);
+
+/* Returns the offset of the first character at or after i which is
+ * not a space, tab, CR or LF, or len if there is none. */
+size_t gc_skip_space(const char *buffer, size_t len, size_t i);
+
+#endif
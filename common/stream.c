@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "stream.h"
+#include "scan.h"
+
+void gcstream_init(gcstream *stream, gcparse *parse) {
+  stream->parse = parse;
+  stream->buf = NULL;
+  stream->head = stream->len = stream->cap = 0;
+  stream->paused = 0;
+  stream->eof = 0;
+}
+
+void gcstream_free(gcstream *stream) {
+  free(stream->buf);
+  gcstream_init(stream, stream->parse);
+}
+
+void gcstream_reset(gcstream *stream) {
+  stream->head = stream->len = 0;
+  stream->paused = 0;
+  stream->eof = 0;
+}
+
+/* Keeps a copy of data for later. */
+static int keep(gcstream *stream, const char *data, size_t len) {
+  if(len == 0) {
+    return 0;
+  }
+  if(stream->cap - stream->len < len && stream->head) {
+    /* Reclaim the space of what's already been parsed */
+    memmove(stream->buf, stream->buf + stream->head, stream->len - stream->head);
+    stream->len -= stream->head;
+    stream->head = 0;
+  }
+  if(stream->cap - stream->len < len) {
+    size_t cap = stream->cap ? stream->cap : 4096;
+    while(cap - stream->len < len) {
+      cap *= 2;
+    }
+    char *buf = realloc(stream->buf, cap);
+    if(!buf) {
+      errno = ENOMEM;
+      return -1;
+    }
+    stream->buf = buf;
+    stream->cap = cap;
+  }
+  memcpy(stream->buf + stream->len, data, len);
+  stream->len += len;
+  return 0;
+}
+
+/* Parses whatever is kept. */
+static void drain(gcstream *stream) {
+  gcparse *parse = stream->parse;
+  const size_t held = stream->len - stream->head;
+  /* A line that will never fit is taken as it is */
+  const int final = stream->eof || held > GCSTREAM_MAXLINE;
+  stream->head += gcparse_lines(parse, stream->buf + stream->head, held, final);
+  stream->paused = parse->stopped;
+  if(stream->head == stream->len) {
+    stream->head = stream->len = 0;
+  }
+}
+
+ssize_t gcstream_push(gcstream *stream, const char *data, size_t len) {
+  gcparse *parse = stream->parse;
+  const size_t before = parse->prog->blockcnt;
+  if(stream->paused) {
+    return keep(stream, data, len);
+  }
+
+  if(stream->len) {
+    /* Complete the line left over from last time */
+    const size_t eol = gc_find_eol(data, len);
+    const size_t used = eol < len ? eol + 1 : len;
+    if(keep(stream, data, used) < 0) {
+      return -1;
+    }
+    drain(stream);
+    data += used;
+    len -= used;
+  }
+
+  if(!stream->paused) {
+    const size_t used = gcparse_lines(parse, data, len, 0);
+    stream->paused = parse->stopped;
+    data += used;
+    len -= used;
+  }
+  if(keep(stream, data, len) < 0) {
+    return -1;
+  }
+  if(!stream->paused && stream->len - stream->head > GCSTREAM_MAXLINE) {
+    drain(stream);
+  }
+  return parse->prog->blockcnt - before;
+}
+
+size_t gcstream_resume(gcstream *stream) {
+  const size_t before = stream->parse->prog->blockcnt;
+  stream->paused = 0;
+  if(stream->len) {
+    drain(stream);
+  }
+  return stream->parse->prog->blockcnt - before;
+}
+
+size_t gcstream_finish(gcstream *stream) {
+  stream->eof = 1;
+  if(stream->paused) {
+    return 0;
+  }
+  return gcstream_resume(stream);
+}
@@ -0,0 +1,49 @@
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "gcode.h"
+
+/* Lines longer than this are cut short rather than buffered forever. */
+#define GCSTREAM_MAXLINE (64 * 1024)
+
+/* Push-style parsing of gcode arriving in arbitrary pieces, e.g. from
+ * a pipe.  Lines which lie entirely within a piece are parsed where
+ * they are; only a line split across pieces is copied, into a buffer
+ * owned by the stream.  Blocks go to the stream's gcparse exactly as
+ * with gcparse_lines, so its online callback sees every line as it is
+ * parsed and may pause the stream by returning nonzero. */
+typedef struct gcstream {
+  gcparse *parse;
+  char *buf;                    /* Unparsed bytes are buf[head] to buf[len] */
+  size_t head, len, cap;
+  char paused;                  /* online asked to stop */
+  char eof;                     /* gcstream_finish has been called */
+} gcstream;
+
+void gcstream_init(gcstream *stream, gcparse *parse);
+
+void gcstream_free(gcstream *stream);
+
+/* Parses every complete line in data, along with any incomplete line
+ * left over from before.  If the stream is or becomes paused, the rest
+ * of data is kept for gcstream_resume.  Returns the number of blocks
+ * appended to the program, or -1 with errno set if there was no memory
+ * to keep what was left, which is then lost. */
+ssize_t gcstream_push(gcstream *stream, const char *data, size_t len);
+
+/* Unpauses the stream and parses whatever it kept, which may pause it
+ * again.  Returns the number of blocks appended. */
+size_t gcstream_resume(gcstream *stream);
+
+/* Signals the end of input, parsing any trailing unterminated line.
+ * If the stream is paused this happens once it has been resumed far
+ * enough.  Returns the number of blocks appended. */
+size_t gcstream_finish(gcstream *stream);
+
+/* Forgets any buffered input, e.g. to start again from scratch. */
+void gcstream_reset(gcstream *stream);
+
+#endif
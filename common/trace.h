@@ -0,0 +1,55 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/* Trace probes, each with two integer arguments.  Where <sys/sdt.h> is
+ * available (HAVE_SYS_SDT) they are USDT probes in the "reprap"
+ * provider, which cost a nop until perf or bpftrace attaches, e.g.
+ *
+ *   bpftrace -e 'usdt:./gcdump:reprap:send { @t[arg0] = nsecs; }
+ *                usdt:./gcdump:reprap:ack { @us = hist((nsecs - @t[arg0]) / 1000); }'
+ *
+ * Built with TRACE_RING, they are also recorded into an in-process ring
+ * buffer of the last GCTRACE_EVENTS events, which is written out at
+ * exit to the file named by the GCTRACE environment variable.  Without
+ * either they compile to nothing.
+ *
+ * Probes, with their arguments:
+ *   parse_start (length, 0), parse_done (result of parse_block, 0)
+ *   update_start (vertices before, after)               gcview
+ *   update_done (vertices before, after)                gcview
+ *   draw_start (frame, 0)                               gcview
+ *   draw_done (frame, vertices drawn)                   gcview
+ *   enqueue (line, length)                              gcdump
+ *   send (line, length)                                 gcdump
+ *   recv (length, 0)                                    gcdump
+ *   ack (line, rr_reply)                                gcdump
+ *   estop (ns to written, ns to sent, or 0)             gcdump
+ * where line counts from 1 the lines gcdump has sent, and is 0 for an
+ * ack with no line sent awaiting one. */
+
+/* Events kept by the ring; a power of two */
+#define GCTRACE_EVENTS 65536
+
+#ifdef HAVE_SYS_SDT
+#include <sys/sdt.h>
+#define GCTRACE_SDT(probe, a, b) DTRACE_PROBE2(reprap, probe, a, b)
+#else
+#define GCTRACE_SDT(probe, a, b) do {} while(0)
+#endif
+
+#ifdef TRACE_RING
+/* Records an event in the ring. */
+void gctrace_record(const char *probe, uint64_t a, uint64_t b);
+#define GCTRACE_RING(probe, a, b) gctrace_record(#probe, (a), (b))
+#else
+#define GCTRACE_RING(probe, a, b) do {} while(0)
+#endif
+
+#define GCTRACE(probe, a, b) do {                 \
+    GCTRACE_SDT(probe, a, b);                     \
+    GCTRACE_RING(probe, a, b);                    \
+  } while(0)
+
+#endif
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include "writer.h"
+
+/* Most a single word can take: a separator, the letter, and a number */
+#define MAXWORD 48
+
+static const double scales[GCWRITER_MAXPRECISION + 1] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+};
+
+/* Numbers too large to scale to an integer are written with %.17g */
+#define MAXFIXED 9e18
+
+/* Where words go once the writer has failed, to be dropped; shared, as
+ * nothing ever reads it */
+static char scratch[MAXWORD];
+
+void gcwriter_init(gcwriter *w, int fd, unsigned precision) {
+  w->buf = malloc(GCWRITER_BUFSIZE);
+  w->len = 0;
+  w->cap = w->buf ? GCWRITER_BUFSIZE : 0;
+  w->fd = fd;
+  w->precision = precision > GCWRITER_MAXPRECISION ? GCWRITER_MAXPRECISION : precision;
+  w->crlf = 0;
+  w->linestart = 1;
+  w->error = w->buf ? 0 : ENOMEM;
+}
+
+void gcwriter_free(gcwriter *w) {
+  free(w->buf);
+  w->buf = NULL;
+  w->len = w->cap = 0;
+}
+
+int gcwriter_flush(gcwriter *w) {
+  if(w->fd >= 0) {
+    size_t done = 0;
+    while(done < w->len && !w->error) {
+      const ssize_t wrote = write(w->fd, w->buf + done, w->len - done);
+      if(wrote < 0) {
+        if(errno != EINTR) {
+          w->error = errno;
+        }
+      } else {
+        done += wrote;
+      }
+    }
+    /* Output after a failure is dropped rather than piling up */
+    w->len = 0;
+  }
+  if(w->error) {
+    errno = w->error;
+    return -1;
+  }
+  return 0;
+}
+
+void gcwriter_reset(gcwriter *w) {
+  w->len = 0;
+  w->linestart = 1;
+}
+
+/* Returns where at least size more bytes can be written.  Once the
+ * writer has failed, returns the scratch buffer instead, which only has
+ * room for a word; see advance. */
+static char *room(gcwriter *w, size_t size) {
+  if(!w->error && w->len + size > w->cap) {
+    gcwriter_flush(w);
+    if(w->len + size > w->cap) {
+      size_t cap = w->cap;
+      while(w->len + size > cap) {
+        cap *= 2;
+      }
+      char *grown = realloc(w->buf, cap);
+      if(grown) {
+        w->buf = grown;
+        w->cap = cap;
+      } else {
+        w->error = ENOMEM;
+      }
+    }
+  }
+  return w->error ? scratch : w->buf + w->len;
+}
+
+/* Takes what was written from room's result up to p as output, unless
+ * it went to the scratch buffer. */
+static void advance(gcwriter *w, const char *p) {
+  if(!w->error) {
+    w->len = p - w->buf;
+  }
+}
+
+/* Writes n in decimal, returning the end. */
+static char *put_uint(char *p, uint64_t n) {
+  char digits[20];
+  size_t i = sizeof(digits);
+  do {
+    digits[--i] = '0' + n % 10;
+    n /= 10;
+  } while(n);
+  memcpy(p, digits + i, sizeof(digits) - i);
+  return p + sizeof(digits) - i;
+}
+
+/* Writes value rounded to precision places, without trailing zeros. */
+static char *put_fixed(char *p, double value, unsigned precision) {
+  const double scaled = value * scales[precision];
+  if(!(scaled < MAXFIXED && scaled > -MAXFIXED)) {
+    /* Also NaN; not gcode, but not worth losing silently either */
+    return p + sprintf(p, "%.17g", value);
+  }
+  int64_t n = (int64_t)(scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+  if(n < 0) {
+    *p++ = '-';
+    n = -n;
+  }
+  const uint64_t scale = (uint64_t)scales[precision];
+  p = put_uint(p, (uint64_t)n / scale);
+  uint64_t frac = (uint64_t)n % scale;
+  if(frac) {
+    while(frac % 10 == 0) {
+      frac /= 10;
+      --precision;
+    }
+    *p++ = '.';
+    char *const end = p + precision;
+    char *q = end;
+    while(q > p) {
+      *--q = '0' + frac % 10;
+      frac /= 10;
+    }
+    p = end;
+  }
+  return p;
+}
+
+/* Starts a word, separating it from the last. */
+static char *start_word(gcwriter *w, char letter) {
+  char *p = room(w, MAXWORD);
+  if(!w->linestart) {
+    *p++ = ' ';
+  }
+  w->linestart = 0;
+  *p++ = letter;
+  return p;
+}
+
+void gcwriter_code(gcwriter *w, char letter, unsigned code) {
+  char *p = start_word(w, letter);
+  advance(w, put_uint(p, code));
+}
+
+void gcwriter_word(gcwriter *w, char letter, double value) {
+  char *p = start_word(w, letter);
+  advance(w, put_fixed(p, value, w->precision));
+}
+
+void gcwriter_text(gcwriter *w, const char *text, size_t len) {
+  char *p = room(w, len);
+  if(!w->error) {               /* Too long for the scratch buffer */
+    memcpy(p, text, len);
+    w->len += len;
+  }
+  if(len) {
+    w->linestart = 0;
+  }
+}
+
+void gcwriter_end(gcwriter *w) {
+  char *p = room(w, 2);
+  if(w->crlf) {
+    *p++ = '\r';
+  }
+  *p++ = '\n';
+  advance(w, p);
+  w->linestart = 1;
+}
+
+void gcwriter_block(gcwriter *w, const gcprogram *prog, size_t b) {
+  if(prog->optdelete[b]) {
+    /* Not a word, so no separator follows */
+    char *p = room(w, 1);
+    *p++ = '/';
+    advance(w, p);
+  }
+  if(prog->line[b]) {
+    gcwriter_code(w, 'N', prog->line[b]);
+  }
+  size_t i;
+  for(i = prog->wordidx[b]; i < prog->wordidx[b + 1]; ++i) {
+    gcwriter_word(w, prog->letters[i], prog->nums[i]);
+  }
+  gcwriter_end(w);
+}
@@ -0,0 +1,64 @@
+#ifndef _WRITER_H_
+#define _WRITER_H_
+
+#include <stddef.h>
+
+#include "program.h"
+
+/* Default decimal places for numbers; enough for micron resolution */
+#define GCWRITER_PRECISION 3
+#define GCWRITER_MAXPRECISION 9
+
+/* Room kept for output before it's written to the file */
+#define GCWRITER_BUFSIZE 65536
+
+/* Formats gcode into an append-only buffer, a word at a time:
+ *
+ *   gcwriter_code(&w, 'G', 1);
+ *   gcwriter_word(&w, 'X', 10.5);
+ *   gcwriter_end(&w);
+ *
+ * gives "G1 X10.5\n".  Numbers are written with at most precision
+ * decimal places, dropping trailing zeros, and never in exponent form.
+ * Once the buffer fills it's written to fd, or grown if fd is -1, so
+ * nothing is allocated per line. */
+typedef struct gcwriter {
+  char *buf;
+  size_t len, cap;
+  int fd;                       /* -1 to keep everything in buf */
+  unsigned precision;
+  char crlf;                    /* End lines with \r\n */
+  char linestart;               /* Nothing written on this line yet */
+  int error;                    /* errno of the first failure */
+} gcwriter;
+
+/* precision is clamped to GCWRITER_MAXPRECISION. */
+void gcwriter_init(gcwriter *w, int fd, unsigned precision);
+
+void gcwriter_free(gcwriter *w);
+
+/* Writes anything buffered to fd.  Returns 0 on success, or -1 with
+ * errno set if this or any earlier write failed, or the buffer ran out
+ * of memory; output after that is dropped. */
+int gcwriter_flush(gcwriter *w);
+
+/* Discards anything buffered, e.g. to reuse a writer with no fd. */
+void gcwriter_reset(gcwriter *w);
+
+/* A word with an integer value, e.g. G1 or M104. */
+void gcwriter_code(gcwriter *w, char letter, unsigned code);
+
+/* A word with a real value, e.g. X10.5. */
+void gcwriter_word(gcwriter *w, char letter, double value);
+
+/* Text copied verbatim, e.g. a comment. */
+void gcwriter_text(gcwriter *w, const char *text, size_t len);
+
+/* Ends the current block. */
+void gcwriter_end(gcwriter *w);
+
+/* Writes block b of prog back out as a line of gcode.  Comments aren't
+ * kept, so a block of nothing else becomes a blank line. */
+void gcwriter_block(gcwriter *w, const gcprogram *prog, size_t b);
+
+#endif
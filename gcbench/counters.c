@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#ifdef LINUX
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "counters.h"
+
+#ifdef LINUX
+static const uint64_t events[COUNTER_COUNT] = {
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_MISSES
+};
+#endif
+
+void counters_open(counters *c) {
+  unsigned i;
+  for(i = 0; i < COUNTER_COUNT; ++i) {
+    c->fd[i] = -1;
+    c->value[i] = COUNTER_UNAVAILABLE;
+#ifdef LINUX
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = events[i];
+    attr.disabled = 1;
+    attr.inherit = 1;           /* Include gcparse_parallel's workers */
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    c->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+  }
+}
+
+void counters_close(counters *c) {
+  unsigned i;
+  for(i = 0; i < COUNTER_COUNT; ++i) {
+    if(c->fd[i] >= 0) {
+      close(c->fd[i]);
+      c->fd[i] = -1;
+    }
+  }
+}
+
+void counters_start(counters *c) {
+#ifdef LINUX
+  unsigned i;
+  for(i = 0; i < COUNTER_COUNT; ++i) {
+    if(c->fd[i] >= 0) {
+      ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+#else
+  (void)c;
+#endif
+}
+
+void counters_stop(counters *c) {
+  unsigned i;
+  for(i = 0; i < COUNTER_COUNT; ++i) {
+    c->value[i] = COUNTER_UNAVAILABLE;
+#ifdef LINUX
+    uint64_t value;
+    if(c->fd[i] >= 0) {
+      ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+      if(read(c->fd[i], &value, sizeof(value)) == sizeof(value)) {
+        c->value[i] = value;
+      }
+    }
+#endif
+  }
+}
+
+#ifdef GCBENCH_WRAP_MALLOC
+/* The linker sends every allocation made by gcbench and libcommon
+ * through these (see -Wl,--wrap in CMakeLists.txt). */
+static uint64_t allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+  __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+  return __real_realloc(ptr, size);
+}
+
+uint64_t allocations(void) {
+  return __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+}
+#else
+uint64_t allocations(void) {
+  return COUNTER_UNAVAILABLE;
+}
+#endif
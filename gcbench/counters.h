@@ -0,0 +1,40 @@
+#ifndef _COUNTERS_H_
+#define _COUNTERS_H_
+
+#include <stdint.h>
+
+/* Hardware events counted around each measurement */
+enum {
+  COUNTER_CYCLES,
+  COUNTER_INSTRUCTIONS,
+  COUNTER_CACHE_MISSES,
+  COUNTER_COUNT
+};
+
+/* Values are COUNTER_UNAVAILABLE if the event can't be counted here,
+ * e.g. because perf_event_paranoid forbids it or we're in a VM. */
+#define COUNTER_UNAVAILABLE UINT64_MAX
+
+typedef struct counters {
+  int fd[COUNTER_COUNT];
+  uint64_t value[COUNTER_COUNT];
+} counters;
+
+/* Opens the counters for this process and any threads it creates
+ * afterwards. */
+void counters_open(counters *c);
+
+void counters_close(counters *c);
+
+/* Zeroes and enables the counters. */
+void counters_start(counters *c);
+
+/* Disables the counters and reads them into value. */
+void counters_stop(counters *c);
+
+/* Returns the number of heap allocations (malloc, calloc and realloc
+ * calls) made so far, or COUNTER_UNAVAILABLE if the build doesn't wrap
+ * them. */
+uint64_t allocations(void);
+
+#endif
@@ -0,0 +1,635 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../common/gcode.h"
+#include "../common/parallel.h"
+#include "../common/scan.h"
+#include "../common/stream.h"
+#include "../common/writer.h"
+#include "../gcview/render.h"
+#include "../gcview/raster.h"
+#include "counters.h"
+
+#define DEFAULT_ITERATIONS 10
+#define DEFAULT_SYNTHETIC 16    /* MiB, when no files are given */
+#define STREAM_CHUNK 65536      /* Typical pipe read */
+#define CULL_GRID 8             /* Views across the model per side */
+#define CULL_HEIGHT 20.0f       /* Above the model, in mm */
+#define RASTER_W 320            /* gcview's default thumbnail */
+#define RASTER_H 240
+
+#define _STR(x) #x
+#define STR(x) _STR(x)
+
+#define HELP "Usage: gcbench [-n iterations] [-b bench,...] [-S MiB] [-t threads] [file...]\n" \
+  "Measures the gcode parser and geometry generation, printing one tab-separated row per benchmark and input.\n" \
+  "\t-n\tTimes to repeat each measurement (default " STR(DEFAULT_ITERATIONS) ")\n" \
+  "\t-b\tBenchmarks to run (default all): strtof, gc_parse_float, parse_block, ingest, ingest_parallel, stream, render, simplify, cull, raster, emit\n" \
+  "\t-S\tAlso measure this much synthetic slicer-style gcode (default " STR(DEFAULT_SYNTHETIC) " MiB if no files are given)\n" \
+  "\t-t\tThreads for ingest_parallel (default one per CPU)\n" \
+  "\tfile\tGcode to measure, e.g. slicer output.\n"
+
+/* Every number in an input, both in place and as a NUL-terminated
+ * copy for the standard library. */
+typedef struct {
+  char *text;                   /* Terminated copies, back to back */
+  size_t textlen, textcap;
+  size_t *offsets, *lengths;
+  size_t count, cap;
+} numbers;
+
+typedef struct input {
+  const char *name;
+  char *data;
+  size_t len;
+  numbers nums;
+  gcprogram prog;               /* Parsed once, for render etc. */
+  geometry geom;                /* Its toolpath, chunked, for cull */
+} input;
+
+static unsigned threads = 0;
+static volatile float sink;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int isnumchar(char c) {
+  return (c >= '0' && c <= '9') || c == '.' || c == '-' || c == '+';
+}
+
+/* Grows what the inputs are loaded into, giving up without the memory */
+static void *xrealloc(void *p, size_t size) {
+  p = realloc(p, size);
+  if(!p) {
+    fprintf(stderr, "Out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+static void add_number(numbers *nums, const char *start, size_t len) {
+  if(nums->count == nums->cap) {
+    nums->cap = nums->cap ? 2 * nums->cap : 1024;
+    nums->offsets = xrealloc(nums->offsets, nums->cap * sizeof(size_t));
+    nums->lengths = xrealloc(nums->lengths, nums->cap * sizeof(size_t));
+  }
+  while(nums->textlen + len + 1 > nums->textcap) {
+    nums->textcap = nums->textcap ? 2 * nums->textcap : 65536;
+    nums->text = xrealloc(nums->text, nums->textcap);
+  }
+  nums->offsets[nums->count] = nums->textlen;
+  nums->lengths[nums->count] = len;
+  memcpy(nums->text + nums->textlen, start, len);
+  nums->text[nums->textlen + len] = 0;
+  nums->textlen += len + 1;
+  ++nums->count;
+}
+
+/* Collects the number of every word in buffer, skipping comments. */
+static void extract_numbers(numbers *nums, const char *buffer, size_t len) {
+  size_t i;
+  for(i = 0; i < len; ++i) {
+    const char c = buffer[i];
+    if(c == ';') {
+      for(; i < len && buffer[i] != '\n'; ++i);
+    } else if(c == '(') {
+      for(; i < len && buffer[i] != ')'; ++i);
+    } else if(((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+              && i + 1 < len && isnumchar(buffer[i + 1])) {
+      const size_t start = ++i;
+      for(; i < len && isnumchar(buffer[i]); ++i);
+      add_number(nums, buffer + start, i - start);
+      --i;
+    }
+  }
+}
+
+static char *read_file(const char *path, size_t *len) {
+  FILE *f = fopen(path, "rb");
+  if(!f) {
+    perror(path);
+    return NULL;
+  }
+  size_t cap = 65536;
+  char *data = xrealloc(NULL, cap);
+  *len = 0;
+  size_t got;
+  while((got = fread(data + *len, 1, cap - *len, f)) > 0) {
+    *len += got;
+    if(*len == cap) {
+      cap *= 2;
+      data = xrealloc(data, cap);
+    }
+  }
+  fclose(f);
+  return data;
+}
+
+/* Deterministic stand-in for rand(), so every run sees the same file */
+static unsigned long lcg(unsigned long *seed) {
+  *seed = *seed * 6364136223846793005UL + 1442695040888963407UL;
+  return *seed >> 33;
+}
+
+/* Generates about len bytes of gcode shaped like slicer output: layers
+ * of short extruding moves, travels, comments and extruder resets. */
+static char *synthesize(size_t target, size_t *len) {
+  char *data = malloc(target + 256);
+  unsigned long seed = 1;
+  float x = 100, y = 100, z = 0, e = 0;
+  size_t n = 0, line = 0;
+  n += sprintf(data + n, "; synthetic\nG21\nG90\nM82\nG28\n");
+  while(n < target) {
+    if(line % 4000 == 0) {
+      z += 0.2f;
+      n += sprintf(data + n, ";LAYER:%zu\nG92 E0\nG1 Z%.3f F7800\n", line / 4000, z);
+      e = 0;
+    }
+    const unsigned long r = lcg(&seed);
+    x += (float)(r % 2001) / 1000 - 1;
+    y += (float)((r >> 11) % 2001) / 1000 - 1;
+    if(r % 53 == 0) {
+      n += sprintf(data + n, "M103\nG0 F9000 X%.3f Y%.3f\nM101\n", x, y);
+    } else if(r % 211 == 0) {
+      n += sprintf(data + n, ";TYPE:FILL\nG1 F1800 X%.3f Y%.3f E%.5f\n", x, y, e += 0.03f);
+    } else {
+      n += sprintf(data + n, "G1 X%.3f Y%.3f E%.5f\n", x, y, e += 0.03f);
+    }
+    ++line;
+  }
+  *len = n;
+  return data;
+}
+
+static void quiet_malformed(gcparse *parse, unsigned real_line,
+                            const char *text, size_t len) {
+  (void)parse;
+  (void)real_line;
+  (void)text;
+  (void)len;
+}
+
+/* Each benchmark does its work once and returns the number of items
+ * (numbers or blocks) processed. */
+
+static size_t bench_strtof(input *in) {
+  float sum = 0;
+  size_t n;
+  for(n = 0; n < in->nums.count; ++n) {
+    sum += strtof(in->nums.text + in->nums.offsets[n], NULL);
+  }
+  sink += sum;
+  return in->nums.count;
+}
+
+static size_t bench_gc_parse_float(input *in) {
+  float sum = 0;
+  size_t n;
+  for(n = 0; n < in->nums.count; ++n) {
+    float f;
+    gc_parse_float(in->nums.text + in->nums.offsets[n], in->nums.lengths[n], &f);
+    sum += f;
+  }
+  sink += sum;
+  return in->nums.count;
+}
+
+static size_t bench_parse_block(input *in) {
+  gcprogram prog;
+  gcprogram_init(&prog);
+  size_t start = 0;
+  while(start < in->len) {
+    const size_t eol = start + gc_find_eol(in->data + start, in->len - start);
+    parse_block(&prog, in->data + start, eol - start);
+    start = eol + 1;
+  }
+  const size_t blocks = prog.blockcnt;
+  gcprogram_free(&prog);
+  return blocks;
+}
+
+/* Parses in as gcview does, either in one go or as a stream. */
+static size_t ingest(input *in, int how) {
+  gcprogram prog;
+  gcparse parse;
+  gcprogram_init(&prog);
+  gcparse_init(&parse, &prog);
+  parse.malformed = &quiet_malformed;
+  switch(how) {
+  case 0:
+    gcparse_lines(&parse, in->data, in->len, 1);
+    break;
+
+  case 1:
+    if(gcparse_parallel(&parse, in->data, in->len, threads) < 0) {
+      perror("Parsing failed");
+      exit(EXIT_FAILURE);
+    }
+    break;
+
+  default:
+  {
+    gcstream stream;
+    gcstream_init(&stream, &parse);
+    size_t off;
+    for(off = 0; off < in->len; off += STREAM_CHUNK) {
+      gcstream_push(&stream, in->data + off,
+                    in->len - off < STREAM_CHUNK ? in->len - off : STREAM_CHUNK);
+    }
+    gcstream_finish(&stream);
+    gcstream_free(&stream);
+    break;
+  }
+  }
+  const size_t blocks = prog.blockcnt;
+  gcprogram_free(&prog);
+  return blocks;
+}
+
+static size_t bench_ingest(input *in) {
+  return ingest(in, 0);
+}
+
+static size_t bench_ingest_parallel(input *in) {
+  return ingest(in, 1);
+}
+
+static size_t bench_stream(input *in) {
+  return ingest(in, 2);
+}
+
+/* Parses in once, for the benchmarks that start from a program. */
+static const gcprogram *parsed(input *in) {
+  if(in->prog.blockcnt == 0 && in->len) {
+    gcparse parse;
+    gcprogram_init(&in->prog);
+    gcparse_init(&parse, &in->prog);
+    parse.malformed = &quiet_malformed;
+    if(gcparse_parallel(&parse, in->data, in->len, threads) < 0) {
+      perror("Parsing failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return &in->prog;
+}
+
+static size_t bench_render(input *in) {
+  toolpath path;
+  geometry geom;
+  toolpath_init(&path, parsed(in));
+  geometry_init(&geom);
+  toolpath_update(&path, &geom);
+  sink += geom.count;
+  geometry_free(&geom);
+  toolpath_free(&path);
+  return in->prog.blockcnt;
+}
+
+/* Merges the toolpath into every level of detail gcview draws, with
+ * its default tolerance. */
+static size_t bench_simplify(input *in) {
+  toolpath path;
+  geometry raw, lods[LODS];
+  simplifier simps[LODS];
+  toolpath_init(&path, parsed(in));
+  geometry_init(&raw);
+  toolpath_update(&path, &raw);
+  simplifier_init_lods(simps, 0.01);
+  int lod;
+  for(lod = 0; lod < LODS; ++lod) {
+    geometry_init(&lods[lod]);
+  }
+  simplify_lods(simps, &raw, lods, 1);
+  for(lod = 0; lod < LODS; ++lod) {
+    sink += lods[lod].count;
+    geometry_free(&lods[lod]);
+  }
+  geometry_free(&raw);
+  toolpath_free(&path);
+  return in->prog.blockcnt;
+}
+
+/* Builds the toolpath once, chunked, for the benchmarks that draw it. */
+static const geometry *drawn(input *in) {
+  if(!in->geom.count) {
+    toolpath path;
+    toolpath_init(&path, parsed(in));
+    toolpath_update(&path, &in->geom);
+    geometry_chunk(&in->geom);
+    toolpath_free(&path);
+  }
+  return &in->geom;
+}
+
+/* Culls the toolpath to each of a grid of close-up views looking down
+ * on the model, as gcview does every frame. */
+static size_t bench_cull(input *in) {
+  const geometry *geom = drawn(in);
+  bounds all;
+  if(geom->count < 2 || geometry_bounds(geom, &all) < 0) {
+    return 0;
+  }
+  int *firsts = malloc(geom->chunkcap * sizeof(int));
+  int *counts = malloc(geom->chunkcap * sizeof(int));
+  /* As gluPerspective(45, 4/3, 0.1, 1000) */
+  const float f = 1 / tanf(45 * M_PI / 360), near = 0.1f, far = 1000;
+  const float projection[16] = {f * 3 / 4, 0, 0, 0,  0, f, 0, 0,
+                                0, 0, (far + near) / (near - far), -1,
+                                0, 0, 2 * far * near / (near - far), 0};
+  size_t views = 0;
+  int x, y;
+  for(x = 0; x < CULL_GRID; ++x) {
+    for(y = 0; y < CULL_GRID; ++y) {
+      const float at[3] = {
+        all.min[0] + (all.max[0] - all.min[0]) * (x + 0.5f) / CULL_GRID,
+        all.min[1] + (all.max[1] - all.min[1]) * (y + 0.5f) / CULL_GRID,
+        all.max[2] + CULL_HEIGHT};
+      const float modelview[16] = {1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,
+                                   -at[0], -at[1], -at[2], 1};
+      frustum planes;
+      frustum_planes(planes, projection, modelview);
+      const size_t strips = geometry_visible(geom, planes, 0, geom->count,
+                                             firsts, counts);
+      size_t i;
+      for(i = 0; i < strips; ++i) {
+        sink += counts[i];
+      }
+      ++views;
+    }
+  }
+  free(firsts);
+  free(counts);
+  return views;
+}
+
+/* Draws the toolpath on the CPU into a thumbnail, as gcview -o does,
+ * without writing it out. */
+static size_t bench_raster(input *in) {
+  const geometry *geom = drawn(in);
+  static raster r;
+  if(!r.rgb && raster_init(&r, RASTER_W, RASTER_H) < 0) {
+    return 0;
+  }
+  bounds box;
+  raster_clear(&r);
+  if(geometry_bounds(geom, &box) == 0) {
+    float mvp[16];
+    raster_camera(mvp, &box, 55, 30, 45, (float)RASTER_W / RASTER_H);
+    raster_strip(&r, geom, mvp);
+  }
+  sink += r.rgb[(RASTER_H / 2 * RASTER_W + RASTER_W / 2) * 3];
+  return geom->count;
+}
+
+/* Writes the program back out as text, into memory. */
+static size_t bench_emit(input *in) {
+  static gcwriter out;
+  if(!out.buf) {
+    gcwriter_init(&out, -1, GCWRITER_PRECISION);
+  }
+  const gcprogram *prog = parsed(in);
+  gcwriter_reset(&out);
+  size_t b;
+  for(b = 0; b < prog->blockcnt; ++b) {
+    gcwriter_block(&out, prog, b);
+  }
+  sink += out.len;
+  return prog->blockcnt;
+}
+
+static const struct {
+  const char *name;
+  size_t (*run)(input *in);
+} benches[] = {
+  {"strtof", &bench_strtof},
+  {"gc_parse_float", &bench_gc_parse_float},
+  {"parse_block", &bench_parse_block},
+  {"ingest", &bench_ingest},
+  {"ingest_parallel", &bench_ingest_parallel},
+  {"stream", &bench_stream},
+  {"render", &bench_render},
+  {"simplify", &bench_simplify},
+  {"cull", &bench_cull},
+  {"raster", &bench_raster},
+  {"emit", &bench_emit},
+  {NULL, NULL}
+};
+
+static int selected(const char *list, const char *name) {
+  if(!list) {
+    return 1;
+  }
+  const size_t len = strlen(name);
+  const char *p;
+  for(p = list; (p = strstr(p, name)) != NULL; p += len) {
+    if((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == 0)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void print_per_item(uint64_t total, double items) {
+  if(total == COUNTER_UNAVAILABLE) {
+    printf("\t-");
+  } else {
+    printf("\t%.4g", total / items);
+  }
+}
+
+/* Runs a benchmark once to warm up, which also lets any warnings out,
+ * then times it with stderr silenced. */
+static void measure(const char *name, size_t (*run)(input *in), input *in,
+                    unsigned iterations, counters *ctrs) {
+  run(in);
+
+  fflush(stderr);
+  const int saved = dup(STDERR_FILENO);
+  const int devnull = open("/dev/null", O_WRONLY);
+  if(devnull >= 0) {
+    dup2(devnull, STDERR_FILENO);
+    close(devnull);
+  }
+
+  const uint64_t allocs = allocations();
+  double best = 0;
+  size_t items = 0;
+  unsigned iter;
+  counters_start(ctrs);
+  for(iter = 0; iter < iterations; ++iter) {
+    const double t0 = now();
+    items = run(in);
+    const double elapsed = now() - t0;
+    if(iter == 0 || elapsed < best) {
+      best = elapsed;
+    }
+  }
+  counters_stop(ctrs);
+  const uint64_t allocd = (allocs == COUNTER_UNAVAILABLE)
+    ? COUNTER_UNAVAILABLE : allocations() - allocs;
+
+  if(saved >= 0) {
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+  }
+
+  const double total = (double)items * iterations;
+  printf("%s\t%s\t%zu\t%zu\t%.6f\t%.0f\t%.1f", name, in->name, in->len, items,
+         best, best > 0 ? items / best : 0, best > 0 ? in->len / best / 1e6 : 0);
+  print_per_item(allocd, total);
+  unsigned c;
+  for(c = 0; c < COUNTER_COUNT; ++c) {
+    print_per_item(ctrs->value[c], total);
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+/* Checks gc_parse_float against strtof; a fast wrong answer is
+ * worthless.  Returns the number of disagreements. */
+static size_t check_numbers(const input *in) {
+  size_t mismatches = 0;
+  size_t n;
+  for(n = 0; n < in->nums.count; ++n) {
+    const char *text = in->nums.text + in->nums.offsets[n];
+    char *endptr;
+    const float expected = strtof(text, &endptr);
+    float got;
+    const size_t used = gc_parse_float(text, in->nums.lengths[n], &got);
+    if(used != (size_t)(endptr - text) || memcmp(&got, &expected, sizeof(float))) {
+      if(mismatches++ < 10) {
+        fprintf(stderr, "MISMATCH: %s: \"%s\": strtof %.9g, gc_parse_float %.9g\n",
+                in->name, text, expected, got);
+      }
+    }
+  }
+  return mismatches;
+}
+
+/* Numbers that round wrongly if taken through double on the way to
+ * float, or that are too long for the fast paths */
+static const char *const tricky[] = {
+  "1.0000000596046448",
+  "-1.0000000596046448",
+  "1.000000059604644775390625",
+  "1.000000059604644775390625000000001",
+  "-1.000000059604644775390624999999999",
+  "0.0000000000000000000000000000000000000000000014012984643248170709",
+  "340282356779733661637539395458142568447.9999",
+  NULL
+};
+
+/* Checks the tricky numbers as above.  Returns the number of
+ * disagreements. */
+static size_t check_tricky(void) {
+  size_t mismatches = 0;
+  unsigned n;
+  for(n = 0; tricky[n]; ++n) {
+    char *endptr;
+    const float expected = strtof(tricky[n], &endptr);
+    float got;
+    const size_t used = gc_parse_float(tricky[n], strlen(tricky[n]), &got);
+    if(used != (size_t)(endptr - tricky[n]) || memcmp(&got, &expected, sizeof(float))) {
+      ++mismatches;
+      fprintf(stderr, "MISMATCH: \"%s\": strtof %.9g, gc_parse_float %.9g\n",
+              tricky[n], expected, got);
+    }
+  }
+  return mismatches;
+}
+
+int main(int argc, char **argv) {
+  unsigned iterations = DEFAULT_ITERATIONS;
+  const char *only = NULL;
+  long synthetic = -1;
+  {
+    int opt;
+    while((opt = getopt(argc, argv, "h?n:b:S:t:")) >= 0) {
+      switch(opt) {
+      case 'n':
+        iterations = strtoul(optarg, NULL, 10);
+        break;
+
+      case 'b':
+        only = optarg;
+        break;
+
+      case 'S':
+        synthetic = strtol(optarg, NULL, 10);
+        break;
+
+      case 't':
+        threads = strtoul(optarg, NULL, 10);
+        break;
+
+      case 'h':
+      case '?':
+        printf("%s", HELP);
+        exit(EXIT_SUCCESS);
+        break;
+
+      default:
+        break;
+      }
+    }
+    if(iterations == 0) {
+      fprintf(stderr, "%s", HELP);
+      exit(EXIT_FAILURE);
+    }
+    if(synthetic < 0) {
+      synthetic = (optind < argc) ? 0 : DEFAULT_SYNTHETIC;
+    }
+  }
+
+  /* Load the corpus */
+  const size_t count = argc - optind + (synthetic > 0);
+  input *inputs = calloc(count, sizeof(input));
+  size_t i;
+  for(i = 0; i < count; ++i) {
+    input *in = &inputs[i];
+    if(optind + i < (size_t)argc) {
+      in->name = argv[optind + i];
+      in->data = read_file(in->name, &in->len);
+      if(!in->data) {
+        exit(EXIT_FAILURE);
+      }
+    } else {
+      in->name = "synthetic";
+      in->data = synthesize(synthetic * 1024 * 1024, &in->len);
+    }
+    extract_numbers(&in->nums, in->data, in->len);
+  }
+
+  size_t mismatches = check_tricky();
+  for(i = 0; i < count; ++i) {
+    mismatches += check_numbers(&inputs[i]);
+  }
+
+  counters ctrs;
+  counters_open(&ctrs);
+  printf("bench\tinput\tbytes\titems\tseconds\titems/s\tMB/s\tallocs/item\tcycles/item\tinstructions/item\tcache-misses/item\n");
+  unsigned b;
+  for(b = 0; benches[b].name; ++b) {
+    if(!selected(only, benches[b].name)) {
+      continue;
+    }
+    for(i = 0; i < count; ++i) {
+      measure(benches[b].name, benches[b].run, &inputs[i], iterations, &ctrs);
+    }
+  }
+  counters_close(&ctrs);
+
+  if(mismatches) {
+    fprintf(stderr, "%zu numbers parsed differently from strtof\n", mismatches);
+  }
+  exit(mismatches ? EXIT_FAILURE : EXIT_SUCCESS);
+}
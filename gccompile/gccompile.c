@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../common/gcode.h"
+#include "../common/gcmap.h"
+#include "../common/gcbin.h"
+#include "../common/parallel.h"
+#include "../common/stream.h"
+#include "../common/decompress.h"
+#include "../common/diag.h"
+
+#define HELP "Usage: gccompile [-s] [-o output] [file]\n" \
+  "Compiles gcode to a binary form which gcview and friends can load without parsing.\n" \
+  "\t-s\tRecord where in the source file each block came from\n" \
+  "\t-o\tFile to write.  Defaults to the input file with its extension replaced by .gcb, or the standard output when reading standard input.\n" \
+  "\tfile\tFile to read from, which may be gzip or zstd compressed.  Standard input is used if this is omitted or -.\n"
+
+/* Parses peek, then everything readable from fd. */
+static int stream_input(gcparse *parse, int fd, const char *peek,
+                        size_t peeklen) {
+  static char buf[65536];
+  gcstream stream;
+  gcstream_init(&stream, parse);
+  int result = gcstream_push(&stream, peek, peeklen) < 0 ? -1 : 0;
+  ssize_t got;
+  while(result == 0 && (got = read(fd, buf, sizeof(buf))) != 0) {
+    if(got < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      result = -1;
+    } else if(gcstream_push(&stream, buf, got) < 0) {
+      result = -1;
+    }
+  }
+  if(result == 0) {
+    gcstream_finish(&stream);
+  }
+  gcstream_free(&stream);
+  return result;
+}
+
+/* Derives foo.gcb from foo.gcode or foo.gcode.gz */
+static char *default_output(const char *input) {
+  const char *slash = strrchr(input, '/');
+  size_t stem = strlen(input);
+  gcdecompress_suffix(input, &stem);
+  const char *dot = input + stem;
+  while(dot > input && *--dot != '.');
+  if(*dot == '.' && (!slash || dot > slash)) {
+    stem = dot - input;
+  }
+  char *output = malloc(stem + strlen(".gcb") + 1);
+  if(!output) {
+    return NULL;
+  }
+  memcpy(output, input, stem);
+  strcpy(output + stem, ".gcb");
+  return output;
+}
+
+int main(int argc, char **argv) {
+  char withsrc = 0;
+  char *input = NULL, *output = NULL;
+  {
+    int opt;
+    while((opt = getopt(argc, argv, "h?so:")) >= 0) {
+      switch(opt) {
+      case 's':
+        withsrc = 1;
+        break;
+
+      case 'o':
+        output = optarg;
+        break;
+
+      case 'h':
+      case '?':
+        printf("%s", HELP);
+        exit(EXIT_SUCCESS);
+        break;
+
+      default:
+        break;
+      }
+    }
+    switch(argc - optind) {
+    case 0:
+      break;
+
+    case 1:
+      if(strcmp(argv[optind], "-") != 0) {
+        input = argv[optind];
+      }
+      break;
+
+    default:
+      fprintf(stderr, "Too many arguments!\n%s", HELP);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  int fd = STDIN_FILENO;
+  if(input) {
+    fd = open(input, O_RDONLY);
+    if(fd < 0) {
+      perror(input);
+      exit(EXIT_FAILURE);
+    }
+  }
+  char peek[GCDECOMPRESS_PEEK];
+  size_t peeklen;
+  fd = gcdecompress_open(fd, peek, &peeklen);
+  if(fd < 0) {
+    perror(input ? input : "Reading input failed");
+    exit(EXIT_FAILURE);
+  }
+
+  gcprogram prog;
+  gcparse parse;
+  gcdiag diag;
+  gcprogram_init(&prog);
+  prog.keepsrc = withsrc;
+  gcparse_init(&parse, &prog);
+  gcdiag_init(&diag);
+  parse.diag = &diag;
+
+  gcmap map;
+  if(gcmap_open(&map, fd) == 0) {
+    if(gcbin_detect(map.data, map.len)) {
+      fprintf(stderr, "%s is already compiled.\n", input ? input : "Input");
+      exit(EXIT_FAILURE);
+    }
+    if(gcparse_parallel(&parse, map.data, map.len, 0) < 0) {
+      perror(input ? input : "Parsing input failed");
+      exit(EXIT_FAILURE);
+    }
+    gcmap_close(&map);
+  } else {
+    if(stream_input(&parse, fd, peek, peeklen) < 0) {
+      perror("Reading input failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  /* Decompressing may have stopped short, which looks like EOF */
+  if(gcdecompress_close(fd) < 0) {
+    perror(input ? input : "Reading input failed");
+    exit(EXIT_FAILURE);
+  }
+  gcdiag_report(&diag, stderr);
+  gcdiag_free(&diag);
+
+  FILE *out = stdout;
+  if(!output && input) {
+    output = default_output(input);
+    if(!output) {
+      perror(input);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if(output && strcmp(output, "-") != 0) {
+    out = fopen(output, "wb");
+    if(!out) {
+      perror(output);
+      exit(EXIT_FAILURE);
+    }
+  } else if(isatty(STDOUT_FILENO)) {
+    fprintf(stderr, "Refusing to write compiled gcode to a terminal; use -o.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if(gcbin_write(&prog, out, withsrc) < 0 || (out != stdout && fclose(out) != 0)) {
+    perror(output ? output : "Writing output failed");
+    exit(EXIT_FAILURE);
+  }
+
+  gcprogram_free(&prog);
+  exit(EXIT_SUCCESS);
+}
@@ -3,20 +3,27 @@
 #include <getopt.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
 
 #include <reprap/comms.h>
 #include <reprap/util.h>
 
+#include "../common/gcode.h"
+#include "../common/gcmap.h"
+#include "../common/stream.h"
+#include "../common/decompress.h"
+#include "../common/trace.h"
+#include "../common/evloop.h"
+#include "../common/estop.h"
+
 #define STR(x) #x
 
 #define DEFAULT_SPEED 19200
-#define READBUF_SIZE 256
-#define INPUT_BLOCK_TERMINATOR "\n"
+#define READBUF_SIZE 4096
 
 #define HELP \
   "\t-p <3|5|t>\t\tUse <3D|5D|tonokip> protocol (default is 3D)\n" \
@@ -27,37 +34,96 @@
 	"\t-s speed\tSerial line speed.  Defaults to " STR(DEFAULT_SPEED) ".\n" \
 	"\t-c\t\tFilter out non-meaningful chars. May stress noncompliant gcode interpreters.\n" \
 	"\t-u number\tMaximum number of messages to send without receipt confirmation.  Unsafe, but necessary for certain broken firmware.\n" \
-  "\t-f file\t\tFile to dump.  If no gcode file is specified, or the file specified is -, gcode is read from the standard input.\n"
+	"\t-t seconds\tAsk for the temperature (M105) this often while sending.\n" \
+  "\t-f file\t\tFile to dump, which may be gzip or zstd compressed.  If no gcode file is specified, or the file specified is -, gcode is read from the standard input.\n"
 
 
 void usage(char* name) {
-	fprintf(stderr, "Usage: %s [-s <speed>] [-p <3|5|t>] [-q] [-v] [-c] [-u <number>] [-f <gcode file>] [port]\n", name);
+	fprintf(stderr, "Usage: %s [-s <speed>] [-p <3|5|t>] [-q] [-v] [-c] [-u <number>] [-t <seconds>] [-f <gcode file>] [port]\n", name);
 }
 
 /* Allows atexit to be used for guaranteed cleanup */
 rr_dev device = NULL;
 int input = STDIN_FILENO;
+/* Lots of firmware seems to not 'ok' the first message */
+unsigned max_unconfirmed = 2;
+/* Lines enqueued, sent and acknowledged, for tracing */
+unsigned long enqueued = 0, sent = 0, acked = 0;
+/* Everything waited on is watched here */
+gcloop loop;
+gcwatch *devwatch = NULL, *inwatch = NULL;
+/* Only the lines themselves are kept, and only while they're sent */
+gcprogram program;
+gcparse parse;
+gcstream stream;
+char ineof = 0;
+/* The signal that stopped us, if any */
+int caught = 0;
 void cleanup() {
 	if(device) {
 		rr_close(device);
     rr_free(device);
 	}
-	if(input != STDIN_FILENO) {
+	if(input >= 0 && input != STDIN_FILENO) {
 		close(input);
 	}
 }
 
+/* Stops the machine, ahead of whatever is still queued, and says how
+ * long that took */
+void halt(const char *why, uint64_t since) {
+  if(!device) {
+    return;
+  }
+  gcestop_times times;
+  const int result = gcestop_send(rr_dev_fd(device), GCESTOP_TIMEOUT, &times);
+  GCTRACE(estop, times.written ? times.written - since : 0,
+          times.drained ? times.drained - since : 0);
+  gcestop_report(&times, since, result, why);
+}
+
+/* Registered first so it runs last: exits as the caught signal would
+ * have, had it never been caught */
+void die() {
+  if(caught) {
+    signal(caught, SIG_DFL);
+    raise(caught);
+  }
+}
+
+/* Always set so the probes fire; data points to verbose for onsend
+ * and to quiet for onrecv */
 void onsend(rr_dev dev, void *data, void *blockdata, const char *line, size_t len) {
+  GCTRACE(send, (uintptr_t)blockdata, len);
+  /* Resends repeat a line already counted */
+  if((uintptr_t)blockdata > sent) {
+    sent = (uintptr_t)blockdata;
+  }
+  if(!*(int*)data) {
+    return;
+  }
   write(STDOUT_FILENO, line, len);
   write(STDOUT_FILENO, "\n", 1);
 }
 
 void onrecv(rr_dev dev, void *data, const char *reply, size_t len) {
+  GCTRACE(recv, len, 0);
+  if(*(int*)data) {
+    return;
+  }
   write(STDOUT_FILENO, reply, len);
   write(STDOUT_FILENO, "\n", 1);
 }
 
 void onreply(rr_dev dev, void *unconfirmed, rr_reply reply, float f) {
+  /* Lines are acknowledged in the order they were sent; an ok with
+   * none awaiting one, e.g. at startup, is no line's */
+  if(reply == RR_OK && acked < sent) {
+    ++acked;
+    GCTRACE(ack, acked, reply);
+  } else {
+    GCTRACE(ack, 0, reply);
+  }
   if(reply == RR_OK) {
     if(*(unsigned*)unconfirmed == 0) {
       fprintf(stderr, "WARNING: Ignoring extra receipt confirmation!\n");
@@ -72,14 +138,14 @@ void onerr(rr_dev dev, void *data, rr_error err, const char *source, size_t len)
   case RR_E_UNCACHED_RESEND:
     fprintf(stderr, "Device requested we resend a line older than we cache!\n"
             "Aborting.\n");
-    /* TODO: Halt extruder/heater on abort */
+    halt("uncached resend", gcestop_now());
     exit(EXIT_FAILURE);
     break;
 
   case RR_E_HARDWARE_FAULT:
     fprintf(stderr, "HARDWARE FAULT!\n"
             "Aborting.\n");
-    /* TODO: Halt extruder/heater on abort */
+    halt("hardware fault", gcestop_now());
     exit(EXIT_FAILURE);
     break;
 
@@ -96,12 +162,120 @@ void onerr(rr_dev dev, void *data, rr_error err, const char *source, size_t len)
   }
 }
 
+/* The firmware is the judge of what's malformed, and of what it
+ * supports: everything is sent regardless */
+void onmalformed(gcparse *parse, unsigned real_line, const char *text, size_t len) {}
+void onunsupported(gcparse *parse, unsigned real_line, char letter, float num) {}
+
+/* Sends each line as it's parsed, stopping once as many are in flight
+ * as the machine is trusted to keep up with */
+int online(gcparse *parse, int result, const char *text, size_t len) {
+  unsigned *unconfirmed = parse->data;
+  /* The line number comes back to onsend as the block data */
+  ++enqueued;
+  GCTRACE(enqueue, enqueued, len);
+  rr_enqueue(device, RR_PRIO_NORMAL, (void*)(uintptr_t)enqueued, text, len);
+  ++*unconfirmed;
+  return *unconfirmed >= max_unconfirmed;
+}
+
 void update_buffered(rr_dev device, void *state, char value) {
   *(int*)state = value;
+  /* Only look for writability if there's data to be written */
+  if(devwatch) {
+    gcloop_set(&loop, devwatch, GCLOOP_READ | (value ? GCLOOP_WRITE : 0));
+  }
+}
+
+void ondevice(gcloop *loop, gcwatch *watch, unsigned events) {
+  int result;
+  if(events & (GCLOOP_READ | GCLOOP_ERROR)) {
+    result = rr_handle_readable(device);
+    if(result < 0) {
+      perror("Reading from device failed");
+      fprintf(stderr, "Aborting.\n");
+      halt("device read failed", gcestop_now());
+      exit(EXIT_FAILURE);
+    }
+  }
+  if(events & GCLOOP_WRITE) {
+    result = rr_handle_writable(device);
+    if(result < 0) {
+      perror("Writing to device failed");
+      fprintf(stderr, "Aborting.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+void oninput(gcloop *loop, gcwatch *watch, unsigned events) {
+  static char readbuf[READBUF_SIZE];
+  int result;
+  do {
+    result = read(input, readbuf, READBUF_SIZE);
+  } while(result < 0 && errno == EINTR);
+  if(result > 0) {
+    /* Lines beyond what the machine can take are held back by the
+     * stream until it's resumed, if there's memory to */
+    if(gcstream_push(&stream, readbuf, result) < 0) {
+      result = -1;
+    }
+  } else if(result == 0) {
+    /* An EOF, unless decompressing stopped short */
+    if(watch) {
+      gcloop_remove(loop, watch);
+      inwatch = NULL;
+    }
+    const int fd = input;
+    input = -1;
+    if(gcdecompress_close(fd) < 0) {
+      result = -1;
+    }
+  }
+  if(result < 0) {
+    perror("Reading from input failed");
+    result = rr_flush(device);
+    if(result < 0) {
+      perror("Flushing output buffers failed");
+    } else {
+      fprintf(stderr, "Output buffers flushed.\n");
+    }
+    fprintf(stderr, "Aborting.\n");
+    halt("input read failed", gcestop_now());
+    exit(EXIT_FAILURE);
+  } else if(result == 0) {
+    /* Send any unterminated last line */
+    ineof = 1;
+    gcstream_finish(&stream);
+  }
+  gcprogram_reset(&program);
+}
+
+/* Asks for the temperature, which is printed along with the other
+ * replies */
+void onpoll(gcloop *loop, gcwatch *watch, unsigned events) {
+  unsigned *unconfirmed = watch->data;
+  static const char m105[] = "M105";
+  ++enqueued;
+  GCTRACE(enqueue, enqueued, sizeof(m105) - 1);
+  rr_enqueue(device, RR_PRIO_NORMAL, (void*)(uintptr_t)enqueued, m105, sizeof(m105) - 1);
+  ++*unconfirmed;
+}
+
+/* Halts the machine the moment we're told to stop, rather than leaving
+ * it to carry on with whatever it was last sent */
+void onsignal(gcloop *loop, gcwatch *watch, unsigned events) {
+  const uint64_t since = gcestop_now();
+  /* Nothing more goes out after the halt, even in this same wait */
+  gcloop_remove(loop, devwatch);
+  devwatch = NULL;
+  halt(watch->value == SIGINT ? "SIGINT" : "SIGTERM", since);
+  caught = watch->value;
 }
 
 int main(int argc, char** argv)
 {
+	atexit(die);
 	atexit(cleanup);
 
 	// Get arguments
@@ -115,11 +289,10 @@ int main(int argc, char** argv)
 	int interactive = isatty(STDIN_FILENO);
   int buffered = 0;
   unsigned unconfirmed = 0;
-  /* Lots of firmware seems to not 'ok' the first message */
-	unsigned max_unconfirmed = 2;
+  unsigned poll_interval = 0;
 	{
 		int opt;
-		while ((opt = getopt(argc, argv, "h?p:qvcs:u:f:")) >= 0) {
+		while ((opt = getopt(argc, argv, "h?p:qvcs:u:t:f:")) >= 0) {
 			switch(opt) {
       case 'p':                 /* Protocol */
         switch(*optarg) {
@@ -154,6 +327,10 @@ int main(int argc, char** argv)
 				max_unconfirmed = strtol(optarg, NULL, 10);
 				break;
 
+			case 't':
+				poll_interval = strtod(optarg, NULL) * 1000;
+				break;
+
 			case 'q':			/* Quiet */
 				quiet = 1;
 				break;
@@ -219,8 +396,8 @@ int main(int argc, char** argv)
 	}
 
   device = rr_create(protocol,
-                     (verbose ? &onsend : NULL), NULL,
-                     (quiet ? NULL : &onrecv), NULL,
+                     &onsend, &verbose,
+                     &onrecv, &quiet,
                      &onreply, &unconfirmed,
                      &onerr, NULL,
                      &update_buffered, &buffered,
@@ -233,6 +410,16 @@ int main(int argc, char** argv)
 		exit(EXIT_FAILURE);
 	}
 
+  /* Signals are waited on along with everything else, so an emergency
+   * stop goes out as soon as one arrives.  This must precede the
+   * decompression thread. */
+  if(gcloop_init(&loop) < 0
+     || !gcloop_signal(&loop, SIGINT, &onsignal, NULL)
+     || !gcloop_signal(&loop, SIGTERM, &onsignal, NULL)) {
+    perror("Creating event loop failed");
+    exit(EXIT_FAILURE);
+  }
+
   /* Open input */
 	if(strncmp("-", filepath, 1) == 0) {
 		if(verbose) {
@@ -252,113 +439,122 @@ int main(int argc, char** argv)
 		}
 		interactive = 0;
 	}
+  /* Compressed input is decompressed on its own thread, into a pipe */
+  char peek[GCDECOMPRESS_PEEK];
+  size_t peeklen;
+  {
+    const int fd = gcdecompress_open(input, peek, &peeklen);
+    if(fd < 0) {
+      fprintf(stderr, "Unable to read gcode: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    input = fd;
+  }
+  gcprogram_init(&program);
+  gcparse_init(&parse, &program);
+  parse.malformed = &onmalformed;
+  parse.unsupported = &onunsupported;
+  parse.online = &online;
+  parse.data = &unconfirmed;
+  gcstream_init(&stream, &parse);
+  if(gcstream_push(&stream, peek, peeklen) < 0) {
+    perror("Reading gcode failed");
+    exit(EXIT_FAILURE);
+  }
+  gcprogram_reset(&program);
+
+  /* Regular files, the standard input included, are sent straight from
+   * a mapping, starting wherever the descriptor is at */
+  gcmap map;
+  const int mapped = (gcmap_open(&map, input) == 0);
+  size_t mapoff = 0;
+  if(mapped) {
+    const off_t at = lseek(input, 0, SEEK_CUR);
+    if(at > 0) {
+      mapoff = (uint64_t)at < map.len ? (size_t)at : map.len;
+    }
+  }
+  /* Set if input can't be waited on, so it's read whenever it's wanted */
+  int unwatchable = 0;
 
   /* Mainloop */
-  fd_set readable, writable;
   int result;
-  int devfd = rr_dev_fd(device);
-  int highfd = devfd > input ? devfd : input;
-  char readbuf[READBUF_SIZE];
-  size_t bytesread = 0;
+  devwatch = gcloop_fd(&loop, rr_dev_fd(device),
+                       GCLOOP_READ | (buffered ? GCLOOP_WRITE : 0),
+                       &ondevice, NULL);
+  if(!mapped) {
+    inwatch = gcloop_fd(&loop, input, 0, &oninput, NULL);
+  }
+  if(!devwatch || (!mapped && !inwatch)) {
+    perror("Watching for I/O failed");
+    exit(EXIT_FAILURE);
+  }
+  if(poll_interval
+     && !gcloop_timer(&loop, poll_interval, poll_interval, &onpoll, &unconfirmed)) {
+    perror("Creating temperature poll timer failed");
+    exit(EXIT_FAILURE);
+  }
   while(1) {
-    FD_ZERO(&readable);
-    FD_ZERO(&writable);
+    /* Send more once the machine has caught up */
     if(unconfirmed < max_unconfirmed) {
-      /* Only look for input when we're confident the machine's
-       * keeping up */
-      FD_SET(input, &readable);
-    }
-    FD_SET(devfd, &readable);
-    /* Only look for writability if there's data to be written */
-    if(buffered) {
-      FD_SET(devfd, &writable);
-    }
-    
-    result = select(highfd + 1, &readable, &writable, NULL, NULL);
-    if(result < 0) {
-      /* Handle error */
-      if(errno == EINTR) {
-        /* select was interrupted before any of the selected events
-         * occurred and before the timeout interval expired. */
-        continue;
-      } else {
-        perror("Waiting on I/O failed");
-        rr_flush(device);
-        fprintf(stderr, "Buffers flushed\n");
-        fprintf(stderr, "Aborting.\n");
-        /* TODO: Halt extruder/heater on abort */
-        exit(EXIT_FAILURE);
+      if(mapped && mapoff < map.len) {
+        mapoff += gcparse_lines(&parse, map.data + mapoff, map.len - mapoff, 1);
+      } else if(stream.paused) {
+        gcstream_resume(&stream);
       }
-    } else if(result > 0) {
-      /* Perform I/O */
-      if(FD_ISSET(devfd, &readable)) {
-        result = rr_handle_readable(device);
-        if(result < 0) {
-          perror("Reading from device failed");
-          fprintf(stderr, "Aborting.\n");
-          /* TODO: Halt extruder/heater on abort */
-          exit(EXIT_FAILURE);
-        }
+      gcprogram_reset(&program);
+    }
+    if(mapped ? mapoff >= map.len : (ineof && !stream.paused)) {
+      /* Got EOF and sent everything */
+      if(verbose) {
+        printf("Got EOF!\n");
       }
-      if(FD_ISSET(devfd, &writable)) {
-        result = rr_handle_writable(device);
-        if(result < 0) {
-          perror("Writing to device failed");
-          fprintf(stderr, "Aborting.\n");
-          exit(EXIT_FAILURE);
-        }
+      result = rr_flush(device);
+      if(result < 0) {
+        perror("Flushing output buffers failed");
+      } else if(verbose) {
+        printf("Output buffers flushed.\n");
       }
-      if(FD_ISSET(input, &readable)) {
-        /* Read input */
-        do {
-          result = read(input, readbuf + bytesread, READBUF_SIZE - bytesread);
-        } while(result < 0 && errno == EINTR);
-        if(result < 0) {
-          perror("Reading from input failed");
-          result = rr_flush(device);
-          if(result < 0) {
-            perror("Flushing output buffers failed");
-          } else {
-            fprintf(stderr, "Output buffers flushed.\n");
-          }
-          fprintf(stderr, "Aborting.\n");
-          /* TODO: Halt extruder/heater on abort */
-          exit(EXIT_FAILURE);
-        } else if(result == 0) {
-          /* Got EOF */
-          if(verbose) {
-            printf("Got EOF!\n");
-          }
-          result = rr_flush(device);
-          if(result < 0) {
-            perror("Flushing output buffers failed");
-          } else if(verbose) {
-            printf("Output buffers flushed.\n");
-          }
-          break;
-        }
+      break;
+    }
 
-        /* Scan for terminator */
-        /* TODO: Don't over-enqueue when multiple blocks are read at once  */
-        const size_t termlen = strlen(INPUT_BLOCK_TERMINATOR);
-        size_t start = 0;
-        bytesread += result;
-        size_t scan = (bytesread > termlen) ? bytesread - termlen : 0;
-        for(; scan <= (bytesread - termlen); ++scan) {
-          if(!strncmp(readbuf + scan, INPUT_BLOCK_TERMINATOR, termlen)) {
-            /* Send off complete input block and continue scanning */
-            rr_enqueue(device, RR_PRIO_NORMAL, NULL, readbuf + start, scan);
-            ++unconfirmed;
-            scan += termlen;
-            start = scan;
-          }
-        }
-        /* Move incomplete input block to beginning of buffer */
-        memmove(readbuf, readbuf+start, bytesread - start);
-        bytesread -= start;
+    /* Only look for input when we're confident the machine's keeping
+     * up */
+    const unsigned want = (!mapped && !ineof && !stream.paused
+                           && unconfirmed < max_unconfirmed) ? GCLOOP_READ : 0;
+    if(inwatch && want != inwatch->events
+       && gcloop_set(&loop, inwatch, want) < 0) {
+      if(errno != EPERM) {
+        perror("Watching for input failed");
+        halt("input watch failed", gcestop_now());
+        exit(EXIT_FAILURE);
       }
+      /* epoll refuses anything that's always ready */
+      gcloop_remove(&loop, inwatch);
+      inwatch = NULL;
+      unwatchable = 1;
+    }
+    if(unwatchable && want) {
+      oninput(&loop, NULL, GCLOOP_READ);
+    }
+
+    if(gcloop_run(&loop, (unwatchable && want) ? 0 : -1) < 0 && errno != EINTR) {
+      perror("Waiting on I/O failed");
+      rr_flush(device);
+      fprintf(stderr, "Buffers flushed\n");
+      fprintf(stderr, "Aborting.\n");
+      halt("event loop failed", gcestop_now());
+      exit(EXIT_FAILURE);
+    }
+    if(caught) {
+      break;
     }
   }
 
+  if(caught) {
+    /* Unblocks the signal for die to raise */
+    gcloop_free(&loop);
+    exit(EXIT_FAILURE);
+  }
 	exit(EXIT_SUCCESS);
 }
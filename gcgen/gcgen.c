@@ -1,12 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
 
 #include <getopt.h>
+#include <unistd.h>
 
 #include "../common/handlesigs.h"
-#include "../common/asprintfx.h"
+#include "../common/writer.h"
 
 #define _STR(x) #x
 #define STR(x) _STR(x)
@@ -47,30 +47,19 @@ void help(char *progname)
 	}
 }
 
-typedef struct gcode_cmd
+/* Writes a block holding a single code, e.g. G21 */
+void gcode(gcwriter *out, char letter, unsigned code)
 {
-	char *command;
-	struct gcode_cmd *next;
-} gcode_cmd;
-
-gcode_cmd* gcode(char *cmd) 
-{
-	gcode_cmd *ret = malloc(sizeof(gcode_cmd));
-
-	ret->command = cmd;
-	ret->next = NULL;
-	
-	return ret;
+	gcwriter_code(out, letter, code);
+	gcwriter_end(out);
 }
 
-void gcode_append(gcode_cmd **tail, char *new) 
+/* Writes a block holding a code and one numeric word, e.g. G1 F1500 */
+void gcode_num(gcwriter *out, char letter, unsigned code, char word, const char *num)
 {
-	assert((*tail)->next == NULL);
-	
-	gcode_cmd *gnew = gcode(new);
-	
-	(*tail)->next = gnew;
-	*tail = gnew;
+	gcwriter_code(out, letter, code);
+	gcwriter_word(out, word, strtod(num, NULL));
+	gcwriter_end(out);
 }
 
 
@@ -106,12 +95,15 @@ int isnum(char *str)
 }
 
 
-char* decodeCoords(char *coord) 
+/* Writes the axis words of an x:y:z or x,y,z argument, any of which may
+ * be left out.  Returns the number of words written, or -1 if coord is
+ * malformed. */
+int decodeCoords(gcwriter *out, char *coord) 
 {
 	/* Choose a delim */
 	size_t i;
 	size_t clen = strlen(coord);
-	char *delim = malloc(sizeof(char));
+	char *delim = malloc(2 * sizeof(char));
 	int colons = 0, commas = 0;
 	for(i = 0; i < clen; i++) {
 		if(coord[i] == ':') {
@@ -126,7 +118,7 @@ char* decodeCoords(char *coord)
 		strcpy(delim, ",");
 	} else {
 		/* Invalid delim usage */
-		return NULL;
+		return -1;
 	}
 
 	/* Insert _ into unspecified coord fields */
@@ -140,7 +132,7 @@ char* decodeCoords(char *coord)
 			blanks++;
 			if(blanks > 2) {
 				/* Invalid arg or no coords set */
-				return NULL;
+				return -1;
 			}
 			explicit[write++] = '_';
 		}
@@ -153,17 +145,16 @@ char* decodeCoords(char *coord)
 	}
 	explicit[write++] = '\0';
 
-	char *ret = calloc(strlen(coord)+3, sizeof(char));
+	int ret = 0;
 	char *tok = strtok(explicit, delim);
 	i = 0;
 	do {
 		if(strcmp("_", tok) != 0) {
 			if(!isnum(tok)) {
-				return NULL;
+				return -1;
 			}
-			strcat(ret, &("X\0Y\0Z\0"[i*2]));
-			strcat(ret, tok);
-			strcat(ret, " ");
+			gcwriter_word(out, "XYZ"[i], strtod(tok, NULL));
+			ret++;
 		}
 		i++;
 	} while((tok = strtok(NULL, delim)) && i < 3);
@@ -178,12 +169,14 @@ int main(int argc, char **argv)
 {
 	init_sig_handling();
 
-	gcode_cmd *head, *tail;
+	/* Output is buffered until the options have all been handled */
+	gcwriter out;
+	gcwriter_init(&out, STDOUT_FILENO, GCWRITER_PRECISION);
+	out.crlf = 1;
 	/* Standard prelude, sets up absolute milimeter coordinates as a
 	 * reliable default. */
-	head = gcode("G21");
-	tail = head;
-	gcode_append(&tail, "G90");
+	gcode(&out, 'G', 21);
+	gcode(&out, 'G', 90);
 
 	/* Handle options */
 	{
@@ -202,44 +195,42 @@ int main(int argc, char **argv)
 					fprintf(stderr, "Speed requires a numeric argument!\n");
 					exit(EXIT_FAILURE);
 				}
-				gcode_append(&tail, asprintfx("G1 F%s", optarg));
+				gcode_num(&out, 'G', 1, 'F', optarg);
 				break;
 
 			case 'p':
 			{
-				static char *coords;
-				coords = decodeCoords(optarg);
+				gcwriter_code(&out, 'G', 0);
+				const int coords = decodeCoords(&out, optarg);
 				
-				if(coords == NULL) {
+				if(coords < 0) {
 					fprintf(stderr, "Invalid coordinate formatting.\n");
 					exit(EXIT_FAILURE);
 				}
-				if(strcmp(coords, "") == 0) {
+				if(coords == 0) {
 					fprintf(stderr, "Rapid movement requires at least one movement.\n");
 					exit(EXIT_FAILURE);
 				}
 
-				gcode_append(&tail, asprintfx("G0 %s", coords));
-				free(coords);
+				gcwriter_end(&out);
 				break;
 			}
 
 			case 'l':
 			{
-				static char *coords;
-				coords = decodeCoords(optarg);
+				gcwriter_code(&out, 'G', 1);
+				const int coords = decodeCoords(&out, optarg);
 				
-				if(coords == NULL) {
+				if(coords < 0) {
 					fprintf(stderr, "Invalid coordinate formatting.\n");
 					exit(EXIT_FAILURE);
 				}
-				if(strcmp(coords, "") == 0) {
+				if(coords == 0) {
 					fprintf(stderr, "Linear movement requires at least one movement.\n");
 					exit(EXIT_FAILURE);
 				}
-				
-				gcode_append(&tail, asprintfx("G1 %s", coords));
-				free(coords);
+
+				gcwriter_end(&out);
 				break;
 			}
 
@@ -248,32 +239,32 @@ int main(int argc, char **argv)
 					fprintf(stderr, "Dwell requires a numeric argument!\n");
 					exit(EXIT_FAILURE);
 				}
-				gcode_append(&tail, asprintfx("G4 P%s", optarg));
+				gcode_num(&out, 'G', 4, 'P', optarg);
 				break;
 
 			case 'i':
-				gcode_append(&tail, "G20");
+				gcode(&out, 'G', 20);
 				break;
 
 			case 'm':
-				gcode_append(&tail, "G21");
+				gcode(&out, 'G', 21);
 				break;
 
 			case 'a':
-				gcode_append(&tail, "G90");
+				gcode(&out, 'G', 90);
 				break;
 
 			case 'r':
-				gcode_append(&tail, "G91");
+				gcode(&out, 'G', 91);
 				break;
 
 			case 'e':
 				if(strcasecmp(optarg, "on") == 0) {
-					gcode_append(&tail, "M101");
+					gcode(&out, 'M', 101);
 				} else if(strcasecmp(optarg, "reverse")==0) {
-					gcode_append(&tail, "M102");
+					gcode(&out, 'M', 102);
 				} else if(strcasecmp(optarg, "off")==0) {
-					gcode_append(&tail, "M103");
+					gcode(&out, 'M', 103);
 				} else {
 					fprintf(stderr, "Argument to extrude must be one of on, reverse, or off.\n");
 					exit(EXIT_FAILURE);
@@ -285,7 +276,7 @@ int main(int argc, char **argv)
 					fprintf(stderr, "Extruder temperature requires a numeric argument!\n");
 					exit(EXIT_FAILURE);
 				}
-				gcode_append(&tail, asprintfx("M104 S%s", optarg));
+				gcode_num(&out, 'M', 104, 'S', optarg);
 				break;
 
 			case 'f':
@@ -294,7 +285,7 @@ int main(int argc, char **argv)
 					fprintf(stderr, "Extruder flowrate requires a numeric argument!\n");
 					exit(EXIT_FAILURE);
 				}
-				gcode_append(&tail, asprintfx("M108 S%s", optarg));
+				gcode_num(&out, 'M', 108, 'S', optarg);
 				break;
 			}
 
@@ -324,15 +315,29 @@ int main(int argc, char **argv)
 				}
 
 				/* Move to minimum */
-				gcode_append(&tail, asprintfx("G1 %s%s%s",
-											  (dox ? "X-999 " : ""),
-											  (doy ? "Y-999 " : ""),
-											  (doz ? "Z-999" : "")));
+				gcwriter_code(&out, 'G', 1);
+				if(dox) {
+					gcwriter_word(&out, 'X', -999);
+				}
+				if(doy) {
+					gcwriter_word(&out, 'Y', -999);
+				}
+				if(doz) {
+					gcwriter_word(&out, 'Z', -999);
+				}
+				gcwriter_end(&out);
 				/* Set as zero */
-				gcode_append(&tail, asprintfx("G92 %s%s%s",
-											  (dox ? "X0 " : ""),
-											  (doy ? "Y0 " : ""),
-											  (doz ? "Z0" : "")));
+				gcwriter_code(&out, 'G', 92);
+				if(dox) {
+					gcwriter_word(&out, 'X', 0);
+				}
+				if(doy) {
+					gcwriter_word(&out, 'Y', 0);
+				}
+				if(doz) {
+					gcwriter_word(&out, 'Z', 0);
+				}
+				gcwriter_end(&out);
 				break;
 			}	
 
@@ -350,11 +355,11 @@ int main(int argc, char **argv)
 		}
 	}
 
-	gcode_cmd *current = head;
-	while(current != NULL) {
-		printf("%s\r\n", current->command);
-		current = current->next;
+	if(gcwriter_flush(&out) < 0) {
+		perror("Writing gcode failed");
+		exit(EXIT_FAILURE);
 	}
+	gcwriter_free(&out);
 
 	exit(EXIT_SUCCESS);
 }
@@ -1,16 +1,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <math.h>
 #include <stdio.h>
 
 #include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <sys/types.h>
-#include <sys/select.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+/* Buffer objects are GL 1.5, past what some gl.h declare by default */
+#define GL_GLEXT_PROTOTYPES
 #ifdef APPLE
 #include <OpenGL/gl.h>
 #include <OpenGL/glu.h>
@@ -21,25 +26,99 @@
 #include <SDL.h>
 
 #include "../common/gcode.h"
+#include "../common/gcmap.h"
+#include "../common/parallel.h"
+#include "../common/gcbin.h"
+#include "../common/stream.h"
+#include "../common/decompress.h"
+#include "../common/diag.h"
+#include "../common/trace.h"
+#include "../common/evloop.h"
+#include "../common/queue.h"
 #include "render.h"
+#include "thumb.h"
+#include "stats.h"
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
 
 #define DEFAULT_W 640
 #define DEFAULT_H 480
 
 #define FRAME_DELAY 17          /* 1/(17ms) = about 60FPS */
 
+#define BATCHES 64              /* Geometry the reader can get ahead by */
+
 #define MOTION_INCREMENT M_PI
 
 #define VIEWDISTANCE (1000.0f)
-
-#define HELP "Usage: gcview [-s] [file]\n" \
-  "\t-s\tShow FPS\n" \
-  "\tfile\tFile to read from.  Standard input is used if this is omitted.\n"
+#define FOV 45.0f               /* Vertical, in degrees */
+
+#define TOLERANCE 0.01          /* Default finest merging, in mm */
+#define LOD_PIXELS 0.5f         /* Merging error that won't be seen */
+
+#define OVERLAY_BAR 2           /* Pixels per frame */
+#define OVERLAY_MS 4.0f         /* Pixels per ms */
+#define OVERLAY_MARGIN 8
+
+#define HELP "Usage: gcview [-s] [-t trace] [-e tolerance] [-o png [-c view] [-g WxH] [-j n]] [file]\n" \
+  "\t-s\tShow FPS, and how long each stage of the last frames took: events (blue), waiting (grey), taking in geometry (yellow) and drawing (red), then the reader's reading (cyan), parsing (green) and building geometry (purple).  The latest figures, with how much has been read and how much memory is used, are shown in the title.\n" \
+  "\t-t file\tWrite how long each stage of every frame took, and how much had been read, to file, as JSON if its name ends in .json and CSV otherwise\n" \
+  "\t-e mm\tMerge nearly collinear segments that stray no further than this from the line drawn (default " STR(TOLERANCE) ").  Each coarser level of detail, drawn from further away, merges " STR(LOD_SCALE) " times as much.\n" \
+  THUMB_HELP \
+  "\tfile\tFile to read from, either gcode or compiled by gccompile, or with -o a directory of them.  Standard input is used if this is omitted.\n" \
+  "Keys:\n" \
+  "\tPgUp/PgDn\tStep the top layer shown; with Shift, the bottom one\n" \
+  "\tl\tShow only the top layer\n" \
+  "\tu\tShow everything up to the top layer\n" \
+  "\ta\tShow all layers, including any yet to be read\n"
   //"When input is read from stdin, SIGHUP will trigger a reset to the initial state.\n"
 
-GLuint dlist;                   /* Display list pointer */
+/* Drawn by the main thread */
+geometry geom[LODS];            /* The toolpath so far, finest first */
+GLuint vbo[LODS][2];            /* Each level's vertices and colors */
+size_t vbocap[LODS];            /* Vertices there's room for in each */
+GLint *stripfirst;              /* What's drawn of the chosen level */
+GLsizei *stripcount;
+size_t stripcap;
+GLfloat projection[16];
+int winwidth = DEFAULT_W, winheight = DEFAULT_H;
+char showstats = 0;
+stats timings;                  /* How long each frame took */
+char *title;                    /* Of the window, before any statistics */
+char alllayers = 1;             /* Otherwise just lolayer to hilayer */
+size_t lolayer, hilayer;
+gcloop loop;                    /* Waits for signals */
+
+/* Read and parsed by the reader thread */
 int gcsource;                   /* FD we're reading gcode from */
-fd_set fdset;
+char gcpeek[GCDECOMPRESS_PEEK]; /* Read from gcsource to see if it was compressed */
+size_t gcpeeklen;
+gcprogram program;              /* Everything read so far */
+gcparse parse;
+gcstream stream;               /* Splits what we read into lines */
+gcdiag diag;                    /* Reported once the input's all parsed */
+float tolerance = TOLERANCE;
+toolpath path;                  /* Turns the program into geometry */
+geometry raw;                   /* Its vertices, before merging */
+simplifier simps[LODS];         /* Merges them for each level */
+/* Geometry not yet handed over */
+typedef struct batch {
+  geometry lods[LODS];
+} batch;
+batch *pending;
+
+/* What the reader's done so far, added to atomically as it goes */
+uint64_t ingest[READER_STAGES]; /* ns in each stage */
+uint64_t ingested;              /* Bytes */
+uint64_t parsedblocks;
+
+/* Geometry handed from the reader to the main thread */
+gcqueue batches;
+char done = 0;
+
+pthread_t reader;
+char stopping = 0;              /* Set to have the reader give up early */
 
 GLfloat *camtransform;
 
@@ -69,139 +148,421 @@ void updatecam() {
   storexform(camtransform, camera.latitude, camera.longitude, camera.radius);
 }
 
-/* Draw the current state of affairs */
-void draw() {
+/* The coarsest level of detail whose merging is too small to see from
+ * where the camera is */
+int picklod() {
+  /* Roughly how much of the model a pixel covers around the origin */
+  const float pixel = 2 * camera.radius * tanf(FOV * M_PI / 360) / winheight;
+  int lod = 0;
+  float tol = tolerance * LOD_SCALE;
+  while(lod + 1 < LODS && tol <= pixel * LOD_PIXELS) {
+    ++lod;
+    tol *= LOD_SCALE;
+  }
+  return lod;
+}
+
+/* Stacks a bar of how long each of n stages took, from the bottom */
+void stack(float x, const uint64_t *ns, int n, const float (*colors)[3]) {
+  float y = OVERLAY_MARGIN;
+  int i;
+  for(i = 0; i < n; ++i) {
+    const float h = ns[i] / 1e6f * OVERLAY_MS;
+    glColor3fv(colors[i]);
+    glVertex2f(x, y);
+    glVertex2f(x + OVERLAY_BAR, y);
+    glVertex2f(x + OVERLAY_BAR, y + h);
+    glVertex2f(x, y + h);
+    y += h;
+  }
+}
+
+/* Draws bars of how long each stage of the last frames took over the
+ * bottom left of the window, the main thread's then the reader's, with
+ * a line at a frame's worth of time */
+void overlay() {
+  static const float colors[STAGES][3] = {
+    {0.3, 0.5, 1.0}, {0.25, 0.25, 0.25}, {1.0, 0.8, 0.0}, {1.0, 0.2, 0.2}
+  };
+  static const float readcolors[READER_STAGES][3] = {
+    {0.0, 0.8, 0.8}, {0.2, 1.0, 0.2}, {0.8, 0.3, 1.0}
+  };
+  const float panel = STATS_FRAMES * OVERLAY_BAR + OVERLAY_MARGIN;
+  glMatrixMode(GL_PROJECTION);
+  glPushMatrix();
+  glLoadIdentity();
+  glOrtho(0, winwidth, 0, winheight, -1, 1);
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glLoadIdentity();
+  glDisable(GL_DEPTH_TEST);
+
+  glBegin(GL_QUADS);
+  const framestats *f;
+  unsigned long back;
+  for(back = 0; (f = stats_get(&timings, back)); ++back) {
+    const float x = OVERLAY_MARGIN + (STATS_FRAMES - 1 - back) * OVERLAY_BAR;
+    stack(x, f->stage, STAGES, colors);
+    stack(x + panel, f->reader, READER_STAGES, readcolors);
+  }
+  glEnd();
+  glBegin(GL_LINES);
+  glColor3f(1, 1, 1);
+  glVertex2f(OVERLAY_MARGIN, OVERLAY_MARGIN + FRAME_DELAY * OVERLAY_MS);
+  glVertex2f(OVERLAY_MARGIN + 2 * panel,
+             OVERLAY_MARGIN + FRAME_DELAY * OVERLAY_MS);
+  glEnd();
+
+  glEnable(GL_DEPTH_TEST);
+  glPopMatrix();
+  glMatrixMode(GL_PROJECTION);
+  glPopMatrix();
+  glMatrixMode(GL_MODELVIEW);
+}
+
+/* Draw the current state of affairs, noting in f what was drawn */
+void draw(framestats *f) {
+  static unsigned long frame = 0;
+  ++frame;
+  GCTRACE(draw_start, frame, 0);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
   glLoadIdentity();
   
   glLoadMatrixf(camtransform);
   
-  glCallList(dlist);
+  const int lod = picklod();
+  glBindBuffer(GL_ARRAY_BUFFER, vbo[lod][0]);
+  glVertexPointer(3, GL_FLOAT, 0, NULL);
+  glBindBuffer(GL_ARRAY_BUFFER, vbo[lod][1]);
+  glColorPointer(3, GL_FLOAT, 0, NULL);
+  /* Layers are the same at every level, only their vertices differ */
+  size_t first = 0, count = geom[lod].count;
+  if(!alllayers) {
+    geometry_layers(&geom[lod], lolayer, hilayer, &first, &count);
+  }
+  /* Only the chunks in view are drawn */
+  frustum planes;
+  frustum_planes(planes, projection, camtransform);
+  const size_t strips = geometry_visible(&geom[lod], planes, first, count,
+                                         stripfirst, stripcount);
+  glMultiDrawArrays(GL_LINE_STRIP, stripfirst, stripcount, strips);
+  if(showstats) {
+    overlay();
+  }
 
   SDL_GL_SwapBuffers();
+  size_t drawn = 0, i;
+  for(i = 0; i < strips; ++i) {
+    drawn += stripcount[i];
+  }
+  f->drawn = drawn;
+  f->lod = lod;
+  GCTRACE(draw_done, frame, drawn);
+}
+
+/* Sets a stage to the time since start, returning the time now */
+uint64_t lap(uint64_t *stage, uint64_t start) {
+  const uint64_t now = stats_now();
+  *stage = now - start;
+  return now;
+}
+
+/* Notes in f what the reader's done since the last frame, and how much
+ * there is to show for it */
+void sample(framestats *f) {
+  static uint64_t last[READER_STAGES];
+  int i;
+  for(i = 0; i < READER_STAGES; ++i) {
+    const uint64_t total = __atomic_load_n(&ingest[i], __ATOMIC_RELAXED);
+    f->reader[i] = total - last[i];
+    last[i] = total;
+  }
+  f->bytes = __atomic_load_n(&ingested, __ATOMIC_RELAXED);
+  f->blocks = __atomic_load_n(&parsedblocks, __ATOMIC_RELAXED);
+  f->vertices = geom[0].count;
+  /* Reading it isn't free, so only when it's wanted */
+  if(showstats || timings.trace) {
+    f->rss = stats_rss();
+  }
+}
+
+/* Puts a frame's figures in the window's title */
+void showtitle(const framestats *f) {
+  char caption[512];
+  uint64_t total = 0;
+  int i;
+  for(i = 0; i < STAGES; ++i) {
+    total += f->stage[i];
+  }
+  snprintf(caption, sizeof(caption),
+           "%s - frame %.1f ms (events %.1f, update %.1f, draw %.1f), "
+           "reader %.1f/%.1f/%.1f ms, %.1f MB read, %llu blocks, "
+           "%zu vertices, %zu drawn, %.0f MB resident",
+           title, total / 1e6, f->stage[STAGE_EVENTS] / 1e6,
+           f->stage[STAGE_UPDATE] / 1e6, f->stage[STAGE_DRAW] / 1e6,
+           f->reader[READER_READ] / 1e6, f->reader[READER_PARSE] / 1e6,
+           f->reader[READER_BUILD] / 1e6, f->bytes / 1e6,
+           (unsigned long long)f->blocks, f->vertices, f->drawn,
+           f->rss / 1e6);
+  SDL_WM_SetCaption(caption, title);
+}
+
+void closetrace(void) {
+  stats_close(&timings);
+}
+
+/* Copies a level's vertices from first on to its buffers, which are
+ * only reallocated when they run out of room */
+void upload(int lod, size_t first) {
+  const geometry *g = &geom[lod];
+  size_t from = first;
+  if(g->cap > vbocap[lod]) {
+    /* Start over with room for as much as the level has */
+    const size_t size = g->cap * 3 * sizeof(float);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo[lod][0]);
+    glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo[lod][1]);
+    glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+    vbocap[lod] = g->cap;
+    from = 0;
+  }
+  if(g->count > from) {
+    const size_t offset = from * 3 * sizeof(float);
+    const size_t len = (g->count - from) * 3 * sizeof(float);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo[lod][0]);
+    glBufferSubData(GL_ARRAY_BUFFER, offset, len, g->verts + from * 3);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo[lod][1]);
+    glBufferSubData(GL_ARRAY_BUFFER, offset, len, g->colors + from * 3);
+  }
 }
 
-void update(gcblock *head) {
-  if(glIsList(dlist)) {
-    glDeleteLists(dlist, 1);
+/* Adds whatever geometry the reader has handed over to what's drawn */
+void update(void) {
+  size_t first[LODS];
+  int lod;
+  for(lod = 0; lod < LODS; ++lod) {
+    first[lod] = geom[lod].count;
+  }
+  batch *b;
+  char any = 0;
+  while((b = gcqueue_pop(&batches))) {
+    any = 1;
+    for(lod = 0; lod < LODS; ++lod) {
+      if(geometry_append(&geom[lod], &b->lods[lod]) < 0) {
+        fprintf(stderr, "Out of memory for geometry!\n");
+        exit(EXIT_FAILURE);
+      }
+      geometry_free(&b->lods[lod]);
+    }
+    free(b);
+  }
+  if(!any) {
+    return;
+  }
+  GCTRACE(update_start, first[0], geom[0].count);
+  for(lod = 0; lod < LODS; ++lod) {
+    if(geom[lod].count > first[lod]) {
+      upload(lod, first[lod]);
+    }
+    if(geometry_chunk(&geom[lod]) < 0) {
+      fprintf(stderr, "Out of memory for geometry!\n");
+      exit(EXIT_FAILURE);
+    }
   }
-  dlist = glGenLists(1);
-  glNewList(dlist, GL_COMPILE);
-  if(head) {
-    render_words(head);
+  /* The finest level has the most chunks, and so may have the most
+   * strips to draw */
+  if(geom[0].chunkcap > stripcap) {
+    stripcap = geom[0].chunkcap;
+    stripfirst = realloc(stripfirst, stripcap * sizeof(GLint));
+    stripcount = realloc(stripcount, stripcap * sizeof(GLsizei));
+    if(!stripfirst || !stripcount) {
+      fprintf(stderr, "Out of memory for geometry!\n");
+      exit(EXIT_FAILURE);
+    }
   }
-  glEndList();
+  GCTRACE(update_done, first[0], geom[0].count);
 }
 
-int readgcode(struct timeval timeout) {
-  static char gcbuf[GCODE_BLOCKSIZE*1024];
-  static gcblock *head = 0, *tail = 0;
-  static unsigned blockidx = 1, real_line = 0;
-  static unsigned sofar = 0;
-  static char needsupdate = 0;
+/* Starts a batch of geometry to hand over. */
+batch *newbatch() {
+  batch *b = malloc(sizeof(batch));
+  if(!b) {
+    fprintf(stderr, "Out of memory for geometry!\n");
+    exit(EXIT_FAILURE);
+  }
+  int lod;
+  for(lod = 0; lod < LODS; ++lod) {
+    geometry_init(&b->lods[lod]);
+  }
+  return b;
+}
 
-  FD_SET(gcsource, &fdset);
+/* Turns the blocks parsed since last time into geometry at each level
+ * of detail and hands it to the main thread.  If the queue's full, the
+ * geometry waits to go with the next lot.  Once everything's read, wait
+ * is set, so that the last of it goes whatever happens. */
+void publish(char wait) {
+  int lod;
+  raw.count = 0;
+  if(toolpath_update(&path, &raw) < 0) {
+    fprintf(stderr, "Out of memory for geometry!\n");
+    exit(EXIT_FAILURE);
+  }
+  if(simplify_lods(simps, &raw, pending->lods, wait) < 0) {
+    fprintf(stderr, "Out of memory for geometry!\n");
+    exit(EXIT_FAILURE);
+  }
+  for(lod = 0; lod < LODS && !pending->lods[lod].count; ++lod);
+  if(lod == LODS) {
+    return;
+  }
+  while(gcqueue_push(&batches, pending) < 0) {
+    if(!wait || __atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+      return;
+    }
+    /* The main thread empties the queue every frame */
+    const struct timespec frame = {0, FRAME_DELAY * 1000000};
+    nanosleep(&frame, NULL);
+  }
+  pending = newbatch();
+}
 
-  int result;
-  result = select(gcsource + 1, &fdset, NULL, NULL, &timeout);
-  if(result < 0) {
-    /* Something went wrong */
-    perror("select");
+/* Loads compiled gcode, or parses an entire regular file in one pass.
+ * Returns 0 if gcsource can't be mapped and must be read incrementally
+ * instead. */
+int mapgcode() {
+  const int result = gcbin_load(&parse, gcsource);
+  if(result == 0) {
+    __atomic_store_n(&ingested, program.mappinglen, __ATOMIC_RELAXED);
+    __atomic_store_n(&parsedblocks, program.blockcnt, __ATOMIC_RELAXED);
+    gcdiag_report(&diag, stderr);
+    return 1;
+  } else if(result != GCBIN_NOT_BINARY) {
+    fprintf(stderr, "%s\n", gcbin_strerror(result));
     exit(EXIT_FAILURE);
-  } else if(result == 0) {
-    if(needsupdate) {
-      /* Timeout expired; update display list */
-      update(head);
-      needsupdate = 0;
+  }
+
+  gcmap map;
+  if(gcmap_open(&map, gcsource) < 0) {
+    if(gcstream_push(&stream, gcpeek, gcpeeklen) < 0) {
+      perror("parse");
+      exit(EXIT_FAILURE);
     }
-  } else if(result > 0) {
-    /* We have data! */
-    if(FD_ISSET(gcsource, &fdset)) {
-      ssize_t bytes = read(gcsource, gcbuf + sofar, GCODE_BLOCKSIZE - sofar - 1);
+    return 0;
+  }
+  if(gcparse_parallel(&parse, map.data, map.len, 0) < 0) {
+    perror("parse");
+    exit(EXIT_FAILURE);
+  }
+  __atomic_store_n(&ingested, map.len, __ATOMIC_RELAXED);
+  gcmap_close(&map);
+  __atomic_store_n(&parsedblocks, program.blockcnt, __ATOMIC_RELAXED);
+  gcdiag_report(&diag, stderr);
+  return 1;
+}
+
+/* Adds the time since start to a stage of the reader's, returning
+ * the time now */
+uint64_t account(int stage, uint64_t start) {
+  const uint64_t now = stats_now();
+  __atomic_fetch_add(&ingest[stage], now - start, __ATOMIC_RELAXED);
+  return now;
+}
+
+/* Waits for gcsource to have something to read, checking every frame
+ * whether the reader's been told to stop.  Returns 0 if it has. */
+int readable(void) {
+  struct pollfd p = {gcsource, POLLIN, 0};
+  while(!__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+    const int result = poll(&p, 1, FRAME_DELAY);
+    /* Errors are left for read to report */
+    if(result > 0 || (result < 0 && errno != EINTR)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* The reader thread: reads and parses gcode, handing over geometry as
+ * it goes, so that neither a slow pipe nor a huge file holds up
+ * drawing */
+void *readgcode(void *unused) {
+  (void)unused;
+  uint64_t t = stats_now();
+  if(mapgcode()) {
+    t = account(READER_PARSE, t);
+  } else {
+    static char gcbuf[GCODE_BLOCKSIZE*1024];
+    ssize_t bytes;
+    while(readable() && (bytes = read(gcsource, gcbuf, sizeof(gcbuf))) != 0) {
+      t = account(READER_READ, t);
       if(bytes < 0) {
+        if(errno == EINTR) {
+          continue;
+        }
         perror("read");
         exit(EXIT_FAILURE);
-      } else if(bytes == 0) {
-        /* We got an EOF */
-        /* Ensure the display list is up to date before bailing out */
-        if(needsupdate) {
-          update(head);
-        }
-        needsupdate = 0;
-        if(gcsource != STDIN_FILENO) {
-          return 0;
-        } /* else { */
-          /* /\* Reset state *\/ */
-          /* sofar = 0; */
-          /* blockidx = 1; */
-          /* real_line = 0; */
-          /* needsupdate = 1; */
-          /* head = NULL; */
-          /* tail = NULL; */
-          /* /\* Free gcode blocks *\/ */
-          /* gcblock *block, *next; */
-          /* for(block = head; block != NULL; block = next) { */
-          /*   next = block->next; */
-          /*   free(block->text); */
-          /*   free(block->words); */
-          /*   free(block); */
-          /* } */
-        return 1;
       }
-
-      size_t i = sofar;
-      size_t block_start = 0;
-      const size_t end = sofar+bytes;
       /* Parse any and all blocks */
-      for(; i < end; ++i) {
-        if(gcbuf[i] == '\n' || gcbuf[i] == '\r') {
-          const size_t len = i - block_start;
-          if(gcbuf[i] == '\n') {
-            real_line++;
-          }
-          if(len < 1) {
-            /* Skip empty lines */
-            continue;
-          }
-          char *text = calloc(len+1, sizeof(char));
-          gcbuf[i] = 0;
-          strncpy(text, gcbuf + block_start, len);
-          gcblock *block = parse_block(gcbuf + block_start, len);
-          block_start = i + 1;
-
-          if(!block) {
-            fprintf(stderr, "WARNING: Line %d: Skipping malformed block\n", real_line);
-            fprintf(stderr, "Block: \"%s\"\n", text);
-            free(text);
-            continue;
-          }
-
-          block->text = text;
-          block->real_line = real_line;
-          block->index = blockidx++;
-
-          /* Append to block list */
-          if(head) {
-            tail->next = block;
-          } else {
-            head = block;
-          }
-          tail = block;
-          needsupdate = 1;
-        }
-      }
-      if(block_start < end) {
-        sofar = end - block_start;
-        if(block_start > 0) {
-          memmove(gcbuf, gcbuf + block_start, sofar);
-          gcbuf[sofar] = 0;
-        }
-      } else {
-        sofar = 0;
+      if(gcstream_push(&stream, gcbuf, bytes) < 0) {
+        perror("parse");
+        exit(EXIT_FAILURE);
       }
+      __atomic_fetch_add(&ingested, bytes, __ATOMIC_RELAXED);
+      __atomic_store_n(&parsedblocks, program.blockcnt, __ATOMIC_RELAXED);
+      t = account(READER_PARSE, t);
+      publish(0);
+      t = account(READER_BUILD, t);
+    }
+    t = account(READER_READ, t);
+    if(__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+      return NULL;
     }
+    /* An EOF, unless decompressing stopped short */
+    const int fd = gcsource;
+    gcsource = -1;
+    if(gcdecompress_close(fd) < 0) {
+      perror("read");
+      exit(EXIT_FAILURE);
+    }
+    /* Parse any unterminated last line */
+    gcstream_finish(&stream);
+    __atomic_store_n(&parsedblocks, program.blockcnt, __ATOMIC_RELAXED);
+    t = account(READER_PARSE, t);
+    gcdiag_report(&diag, stderr);
+    /* TODO: When reading stdin, SIGHUP could reset to the initial state
+     * and start reading again */
   }
-  return 1;
+  /* Ensure everything's handed over before bailing out */
+  publish(1);
+  account(READER_BUILD, t);
+  return NULL;
+}
+
+/* Tells the reader to stop and waits for it, so that it's not left
+ * using what the other exit handlers tear down */
+void stopreader(void) {
+  if(pthread_equal(pthread_self(), reader)) {
+    return;
+  }
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+  pthread_join(reader, NULL);
+}
+
+/* Waits up to ms milliseconds for signals. */
+void idle(int ms) {
+  if(gcloop_run(&loop, ms) < 0 && errno != EINTR) {
+    perror("Waiting for signals failed");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Ends the main loop cleanly */
+void onsignal(gcloop *loop, gcwatch *watch, unsigned events) {
+  (void)loop;
+  (void)watch;
+  (void)events;
+  done = 1;
 }
 
 void resize(int width, int height) {
@@ -214,14 +575,81 @@ void resize(int width, int height) {
 
   glMatrixMode(GL_PROJECTION);
   glLoadIdentity();
-  gluPerspective(45.0f, ratio, 0.1f, VIEWDISTANCE);
+  gluPerspective(FOV, ratio, 0.1f, VIEWDISTANCE);
+  glGetFloatv(GL_PROJECTION_MATRIX, projection);
+  winwidth = width;
+  winheight = height;
 
   glMatrixMode(GL_MODELVIEW);
   glLoadIdentity();
 }
 
+/* Says which layers are shown */
+void reportlayers() {
+  const layer *layers = geom[0].layers;
+  if(alllayers) {
+    printf("Showing all %zu layers\n", geom[0].layercnt);
+  } else {
+    printf("Showing layers %zu to %zu of %zu (Z %.2f to %.2f)\n",
+           lolayer + 1, hilayer + 1, geom[0].layercnt,
+           layers[lolayer].z, layers[hilayer].z);
+  }
+}
+
+/* Moves the top or bottom layer shown by delta, keeping the bottom no
+ * higher than the top */
+void steplayers(char top, long delta) {
+  const size_t n = geom[0].layercnt;
+  if(!n) {
+    return;
+  }
+  if(alllayers) {
+    alllayers = 0;
+    lolayer = 0;
+    hilayer = n - 1;
+  }
+  size_t *which = top ? &hilayer : &lolayer;
+  long l = (long)*which + delta;
+  *which = l < 0 ? 0 : ((size_t)l >= n ? n - 1 : (size_t)l);
+  if(lolayer > hilayer) {
+    if(top) {
+      lolayer = hilayer;
+    } else {
+      hilayer = lolayer;
+    }
+  }
+}
+
 void handlekey(SDL_keysym *key) {
+  const char shift = (key->mod & KMOD_SHIFT) != 0;
   switch(key->sym) {
+  case SDLK_PAGEUP:
+    steplayers(!shift, 1);
+    reportlayers();
+    break;
+
+  case SDLK_PAGEDOWN:
+    steplayers(!shift, -1);
+    reportlayers();
+    break;
+
+  case SDLK_l:
+    steplayers(1, 0);
+    lolayer = hilayer;
+    reportlayers();
+    break;
+
+  case SDLK_u:
+    steplayers(1, 0);
+    lolayer = 0;
+    reportlayers();
+    break;
+
+  case SDLK_a:
+    alllayers = 1;
+    reportlayers();
+    break;
+
   case SDLK_PLUS:
   case SDLK_EQUALS:
     camera.radius -= 10;
@@ -259,18 +687,20 @@ void handlekey(SDL_keysym *key) {
 }
 
 void cleanup(void) {
-  if(gcsource != STDIN_FILENO) {
+  if(gcsource >= 0 && gcsource != STDIN_FILENO) {
     close(gcsource);
   }
 }
 
 int main(int argc, char** argv) {
-  char showfps = 0;
   char *file = 0;
+  const char *tracefile = NULL;
+  thumbopts thumbs;
+  thumb_defaults(&thumbs);
   /* Handle args */
   {
     int opt;
-    while((opt = getopt(argc, argv, "h?s")) >= 0) {
+    while((opt = getopt(argc, argv, "h?st:e:" THUMB_OPTS)) >= 0) {
       switch(opt) {
       case 'h':
       case '?':
@@ -279,10 +709,23 @@ int main(int argc, char** argv) {
         break;
 
       case 's':
-        showfps = 1;
+        showstats = 1;
+        break;
+
+      case 't':
+        tracefile = optarg;
+        break;
+
+      case 'e':
+        tolerance = strtof(optarg, NULL);
+        if(tolerance < 0) {
+          fprintf(stderr, "Tolerance must not be negative\n");
+          exit(EXIT_FAILURE);
+        }
         break;
 
       default:
+        thumb_option(&thumbs, opt, optarg);
         break;
       }
     }
@@ -294,6 +737,10 @@ int main(int argc, char** argv) {
     default:
       break;
     }
+    /* Thumbnails need no window */
+    if(thumbs.output) {
+      exit(thumb_run(&thumbs, file));
+    }
     {
       /* Work out what we're reading from */
       gcsource = STDIN_FILENO;
@@ -304,22 +751,32 @@ int main(int argc, char** argv) {
           perror(file);
           exit(EXIT_FAILURE);
         }
-
-        int flags;
-        if (-1 == (flags = fcntl(gcsource, F_GETFL, 0))) {
-          flags = 0;
-        }
-        if(-1 == fcntl(gcsource, F_SETFL, flags | O_NONBLOCK)) {
-          fprintf(stderr, "Failed to enter non-blocking mode: ");
-          perror("fcntl");
-          exit(EXIT_FAILURE);
-        }
       }
-      /* Init select data */
-      FD_ZERO(&fdset);
+      /* Compressed gcode is decompressed on its own thread, into a
+       * pipe we read instead */
+      gcsource = gcdecompress_open(gcsource, gcpeek, &gcpeeklen);
+      if(gcsource < 0) {
+        perror(file ? file : "stdin");
+        exit(EXIT_FAILURE);
+      }
     }
   }
 
+  if(stats_open(&timings, tracefile) < 0) {
+    perror(tracefile);
+    exit(EXIT_FAILURE);
+  }
+  atexit(closetrace);
+
+  /* Before SDL or the reader starts any threads, so that only we take
+   * the signals */
+  if(gcloop_init(&loop) < 0
+     || !gcloop_signal(&loop, SIGINT, &onsignal, NULL)
+     || !gcloop_signal(&loop, SIGTERM, &onsignal, NULL)) {
+    perror("Creating event loop failed");
+    exit(EXIT_FAILURE);
+  }
+
   /* Init SDL */
   if(SDL_Init(SDL_INIT_VIDEO) < 0) {
     fprintf(stderr, "Video initialization failed: %s\n", SDL_GetError());
@@ -357,7 +814,6 @@ int main(int argc, char** argv) {
       exit(EXIT_FAILURE);
     }
 
-    char *title;
     if(file) {
       title = calloc(strlen(argv[0]) + strlen(file) + 2, sizeof(char));
       strcpy(title, argv[0]);
@@ -369,7 +825,6 @@ int main(int argc, char** argv) {
       strcat(title, " stdin");
     }
     SDL_WM_SetCaption(title, title);
-    free(title);
   }
 
 	/* Configure OpenGL */
@@ -380,12 +835,33 @@ int main(int argc, char** argv) {
   /*glEnable(GL_MULTISAMPLE);*/
   glDepthFunc(GL_LEQUAL);
   glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
+  glGenBuffers(LODS * 2, &vbo[0][0]);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_COLOR_ARRAY);
 
   /* Prepare for mainloop */
   camtransform = calloc(16, sizeof(GLfloat));
 
   /* Initialize state */
-  update(0);
+  gcprogram_init(&program);
+  gcparse_init(&parse, &program);
+  gcdiag_init(&diag);
+  parse.diag = &diag;
+  gcstream_init(&stream, &parse);
+  toolpath_init(&path, &program);
+  geometry_init(&raw);
+  simplifier_init_lods(simps, tolerance);
+  {
+    int lod;
+    for(lod = 0; lod < LODS; ++lod) {
+      geometry_init(&geom[lod]);
+    }
+  }
+  pending = newbatch();
+  if(gcqueue_init(&batches, BATCHES) < 0) {
+    fprintf(stderr, "Out of memory!\n");
+    exit(EXIT_FAILURE);
+  }
   camera.latitude = 0;
   camera.longitude = 0;
   camera.radius = 100;
@@ -394,13 +870,23 @@ int main(int argc, char** argv) {
 
   /* Enter main loop */
   SDL_Event e;
-  char done = 0;
-  char gcdone = 0;
+  {
+    const int result = pthread_create(&reader, NULL, &readgcode, NULL);
+    if(result != 0) {
+      fprintf(stderr, "Starting reader thread failed: %s\n", strerror(result));
+      exit(EXIT_FAILURE);
+    }
+    /* Runs before the handlers registered earlier */
+    atexit(stopreader);
+  }
   char dragging = 0;
   struct timeval t0, t, dt;
   unsigned frames = 0;
   float fps_elapsed = 0;
   while(!done) {
+    framestats f;
+    memset(&f, 0, sizeof(f));
+    f.start = stats_now();
     dt.tv_sec = 0;
     dt.tv_usec = 0;
     gettimeofday(&t0, NULL);
@@ -454,22 +940,34 @@ int main(int argc, char** argv) {
         break;
       }
     }
-    while(!gcdone && dt.tv_sec == 0 && dt.tv_usec <= (1000 * FRAME_DELAY)) {
-      struct timeval timeout = {0, (1000 * FRAME_DELAY) - dt.tv_usec};
-      gcdone = !readgcode(timeout);
+    uint64_t now = lap(&f.stage[STAGE_EVENTS], f.start);
+    /* Spend the rest of the frame waiting for a signal */
+    while(!done) {
       gettimeofday(&t, NULL);
-      dt.tv_sec = t.tv_sec - t0.tv_sec;
-      dt.tv_usec = t.tv_usec - t0.tv_usec;
+      const long elapsed = (t.tv_sec - t0.tv_sec) * 1000
+        + (t.tv_usec - t0.tv_usec) / 1000;
+      if(elapsed >= FRAME_DELAY) {
+        break;
+      }
+      idle(FRAME_DELAY - elapsed);
     }
-    draw();
+    now = lap(&f.stage[STAGE_IDLE], now);
+    /* Whatever arrived this frame is drawn this frame */
+    update();
+    now = lap(&f.stage[STAGE_UPDATE], now);
+    draw(&f);
+    lap(&f.stage[STAGE_DRAW], now);
+    sample(&f);
+    stats_frame(&timings, &f);
     ++frames;
-    if(showfps) {
+    if(showstats) {
       gettimeofday(&t, NULL);
       dt.tv_sec = t.tv_sec - t0.tv_sec;
       dt.tv_usec = t.tv_usec - t0.tv_usec;
       fps_elapsed += (dt.tv_usec / 1000000.0) + dt.tv_sec;
       if(frames >= 30) {
         printf("FPS: %f\n", ((float)frames)/fps_elapsed);
+        showtitle(&f);
         frames = 0;
         fps_elapsed = 0;
       }
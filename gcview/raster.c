@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "raster.h"
+
+int raster_init(raster *r, unsigned width, unsigned height) {
+  const size_t pixels = (size_t)width * height;
+  r->width = width;
+  r->height = height;
+  r->rgb = malloc(pixels * 3);
+  r->depth = malloc(pixels * sizeof(float));
+  if(!r->rgb || !r->depth) {
+    raster_free(r);
+    return -1;
+  }
+  return 0;
+}
+
+void raster_free(raster *r) {
+  free(r->rgb);
+  free(r->depth);
+  r->rgb = NULL;
+  r->depth = NULL;
+}
+
+void raster_clear(raster *r) {
+  const size_t pixels = (size_t)r->width * r->height;
+  memset(r->rgb, 0, pixels * 3);
+  size_t i;
+  for(i = 0; i < pixels; ++i) {
+    r->depth[i] = 1;
+  }
+}
+
+/* out = a b, all column-major */
+static void multiply(float *out, const float *a, const float *b) {
+  int r, c, k;
+  for(c = 0; c < 4; ++c) {
+    for(r = 0; r < 4; ++r) {
+      out[c * 4 + r] = 0;
+      for(k = 0; k < 4; ++k) {
+        out[c * 4 + r] += a[k * 4 + r] * b[c * 4 + k];
+      }
+    }
+  }
+}
+
+void raster_camera(float *mvp, const bounds *box, float latitude,
+                   float spin, float fov, float aspect) {
+  float center[3], radius = 0;
+  int i;
+  for(i = 0; i < 3; ++i) {
+    const float half = (box->max[i] - box->min[i]) / 2;
+    center[i] = box->min[i] + half;
+    radius += half * half;
+  }
+  radius = radius > 0 ? sqrtf(radius) : 1;
+
+  /* Far enough back that the bounding sphere fits the narrower way */
+  const float f = 1 / tanf(fov * M_PI / 360);
+  const float fit = aspect < 1 ? atanf(aspect / f) : atanf(1 / f);
+  const float distance = radius / sinf(fit);
+  float near = distance - radius;
+  if(near < distance / 1000) {
+    near = distance / 1000;
+  }
+  const float far = distance + radius;
+
+  const float s = sinf(spin * M_PI / 180), c = cosf(spin * M_PI / 180);
+  const float turn[16] = {c, -s, 0, 0,  s, c, 0, 0,  0, 0, 1, 0,
+                          -(c * center[0] + s * center[1]),
+                          s * center[0] - c * center[1], -center[2], 1};
+  const float ls = sinf(latitude * M_PI / 180), lc = cosf(latitude * M_PI / 180);
+  const float tilt[16] = {1, 0, 0, 0,  0, lc, -ls, 0,  0, ls, lc, 0,
+                          0, 0, -distance, 1};
+  const float projection[16] = {f / aspect, 0, 0, 0,  0, f, 0, 0,
+                                0, 0, (far + near) / (near - far), -1,
+                                0, 0, 2 * far * near / (near - far), 0};
+  float view[16];
+  multiply(view, tilt, turn);
+  multiply(mvp, projection, view);
+}
+
+static void transform(const float *m, const float *v, float *out) {
+  int i;
+  for(i = 0; i < 4; ++i) {
+    out[i] = m[i] * v[0] + m[4 + i] * v[1] + m[8 + i] * v[2] + m[12 + i];
+  }
+}
+
+/* Finds the part of the segment from a to b, in clip space, that's in
+ * view, as fractions of the way from a.  Returns 0 if none of it is. */
+static int clip(const float *a, const float *b, float *t0, float *t1) {
+  *t0 = 0;
+  *t1 = 1;
+  int i, sign;
+  for(i = 0; i < 3; ++i) {
+    for(sign = -1; sign <= 1; sign += 2) {
+      /* Inside where w + sign * that coordinate >= 0 */
+      const float da = a[3] + sign * a[i], db = b[3] + sign * b[i];
+      if(da < 0 && db < 0) {
+        return 0;
+      }
+      if(da < 0) {
+        const float t = da / (da - db);
+        if(t > *t0) {
+          *t0 = t;
+        }
+      } else if(db < 0) {
+        const float t = da / (da - db);
+        if(t < *t1) {
+          *t1 = t;
+        }
+      }
+    }
+  }
+  return *t0 <= *t1;
+}
+
+/* Takes a point t of the way from a to b in clip space to the pixel
+ * it falls on, and its depth */
+static void project(const raster *r, const float *a, const float *b,
+                    float t, float *out) {
+  float p[4];
+  int i;
+  for(i = 0; i < 4; ++i) {
+    p[i] = a[i] + (b[i] - a[i]) * t;
+  }
+  out[0] = (p[0] / p[3] + 1) / 2 * r->width;
+  out[1] = (1 - p[1] / p[3]) / 2 * r->height;
+  out[2] = p[2] / p[3];
+}
+
+void raster_strip(raster *r, const geometry *geom, const float *mvp) {
+  if(!geom->count) {
+    return;
+  }
+  float last[4], next[4];
+  transform(mvp, geom->verts, last);
+  size_t v;
+  for(v = 1; v < geom->count; ++v, memcpy(last, next, sizeof(last))) {
+    transform(mvp, geom->verts + v * 3, next);
+    float t0, t1;
+    if(!clip(last, next, &t0, &t1)) {
+      continue;
+    }
+    float from[3], to[3];
+    project(r, last, next, t0, from);
+    project(r, last, next, t1, to);
+
+    const float *color = geom->colors + v * 3;
+    const unsigned char rgb[3] = {color[0] * 255 + 0.5f,
+                                  color[1] * 255 + 0.5f,
+                                  color[2] * 255 + 0.5f};
+    /* A pixel per step along the longer axis; depth after the divide
+     * varies linearly across the screen */
+    const float dx = to[0] - from[0], dy = to[1] - from[1];
+    const float dz = to[2] - from[2];
+    const float len = fabsf(dx) > fabsf(dy) ? fabsf(dx) : fabsf(dy);
+    const unsigned steps = ceilf(len);
+    unsigned i;
+    for(i = 0; i <= steps; ++i) {
+      const float t = steps ? (float)i / steps : 0;
+      const float x = from[0] + dx * t, y = from[1] + dy * t;
+      if(x < 0 || y < 0 || x >= r->width || y >= r->height) {
+        continue;
+      }
+      const size_t pixel = (size_t)y * r->width + (size_t)x;
+      const float z = from[2] + dz * t;
+      if(z <= r->depth[pixel]) {
+        r->depth[pixel] = z;
+        memcpy(r->rgb + pixel * 3, rgb, 3);
+      }
+    }
+  }
+}
@@ -0,0 +1,33 @@
+#ifndef _RASTER_H_
+#define _RASTER_H_
+
+#include "render.h"
+
+/* An image drawn on the CPU, for want of a GPU, with a depth per pixel
+ * so nearer lines hide those behind. */
+typedef struct raster {
+  unsigned width, height;
+  unsigned char *rgb;           /* Rows from the top */
+  float *depth;
+} raster;
+
+/* Returns -1 if memory ran out. */
+int raster_init(raster *r, unsigned width, unsigned height);
+
+void raster_free(raster *r);
+
+/* Fills with black, as far away as can be. */
+void raster_clear(raster *r);
+
+/* Makes a column-major matrix from model to clip space that fits box
+ * in view, turned spin degrees about Z and then tilted latitude degrees
+ * away from looking straight down, with a vertical field of view of fov
+ * degrees. */
+void raster_camera(float *mvp, const bounds *box, float latitude,
+                   float spin, float fov, float aspect);
+
+/* Draws geom's line strip, each segment in the color of the vertex it
+ * ends at. */
+void raster_strip(raster *r, const geometry *geom, const float *mvp);
+
+#endif
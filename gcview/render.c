@@ -1,185 +1,515 @@
-#ifdef APPLE
-#include <OpenGL/gl.h>
-#else
-#include <GL/gl.h>
-#endif
-#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 
 #include "render.h"
 
-void render_words(gcblock *head) {
-  point curr = {0.0, 0.0, 0.0}, next = {0.0, 0.0, 0.0}, peek = {0.0, 0.0, 0.0};
-  char extruding = 0;
-  char relative = 0;
-  char moved = 0;
-  char statechange = 0;        /* Force line drawing */
-  int lastg;
-  
-  /* Evaluate blocks sequentially */
-  glBegin(GL_LINE_STRIP);
-  /*glVertex3f(peek.x, peek.y, peek.z);*/
-  glVertex3f(curr.x, curr.y, curr.z);
-  gcblock *block;
-  for(block = head; block != NULL; block = block->next) {
-    /* Evaluate all words in the block */
+#define INITIAL_VERTS 1024
+
+/* Makes room for at least n vertices.  Returns -1 on failure. */
+static int reserve(geometry *geom, size_t n) {
+  if(n <= geom->cap) {
+    return 0;
+  }
+  size_t cap = geom->cap ? geom->cap : INITIAL_VERTS;
+  while(cap < n) {
+    cap *= 2;
+  }
+  float *verts = realloc(geom->verts, cap * 3 * sizeof(float));
+  if(!verts) {
+    return -1;
+  }
+  geom->verts = verts;
+  float *colors = realloc(geom->colors, cap * 3 * sizeof(float));
+  if(!colors) {
+    return -1;
+  }
+  geom->colors = colors;
+  geom->cap = cap;
+  return 0;
+}
+
+static void setcolor(float *c, float r, float g, float b) {
+  c[0] = r;
+  c[1] = g;
+  c[2] = b;
+}
+
+/* Stretches a box to take in v */
+static void bound(bounds *b, const float *v) {
+  int i;
+  for(i = 0; i < 3; ++i) {
+    if(v[i] < b->min[i]) {
+      b->min[i] = v[i];
+    }
+    if(v[i] > b->max[i]) {
+      b->max[i] = v[i];
+    }
+  }
+}
+
+/* Shrinks a box to just v */
+static void enclose(bounds *b, const float *v) {
+  memcpy(b->min, v, sizeof(b->min));
+  memcpy(b->max, v, sizeof(b->max));
+}
+
+static void push(geometry *geom, const float *v, const float *color) {
+  memcpy(geom->verts + geom->count * 3, v, 3 * sizeof(float));
+  memcpy(geom->colors + geom->count * 3, color, 3 * sizeof(float));
+  ++geom->count;
+  if(geom->layercnt) {
+    bound(&geom->layers[geom->layercnt - 1].box, v);
+  }
+}
+
+/* Begins a layer at the last vertex pushed.  Returns -1 on failure. */
+static int addlayer(geometry *geom, float z) {
+  if(geom->layercnt == geom->layercap) {
+    const size_t cap = geom->layercap ? 2 * geom->layercap : 64;
+    layer *layers = realloc(geom->layers, cap * sizeof(layer));
+    if(!layers) {
+      return -1;
+    }
+    geom->layers = layers;
+    geom->layercap = cap;
+  }
+  layer *l = &geom->layers[geom->layercnt++];
+  const float *v = geom->verts + (geom->count - 1) * 3;
+  l->first = geom->count - 1;
+  l->z = z;
+  enclose(&l->box, v);
+  return 0;
+}
+
+static void pushpoint(geometry *geom, point p, const float *color) {
+  const float v[3] = {p.x, p.y, p.z};
+  push(geom, v, color);
+}
+
+void geometry_init(geometry *geom) {
+  geom->verts = NULL;
+  geom->colors = NULL;
+  geom->count = 0;
+  geom->cap = 0;
+  geom->layers = NULL;
+  geom->layercnt = geom->layercap = 0;
+  geom->chunks = geom->groups = NULL;
+  geom->chunked = geom->chunkcap = 0;
+}
+
+void geometry_free(geometry *geom) {
+  free(geom->verts);
+  free(geom->colors);
+  free(geom->layers);
+  free(geom->chunks);
+  free(geom->groups);
+  geometry_init(geom);
+}
+
+void geometry_clear(geometry *geom) {
+  geom->count = 0;
+  geom->layercnt = 0;
+  geom->chunked = 0;
+}
+
+int geometry_append(geometry *geom, const geometry *src) {
+  if(reserve(geom, geom->count + src->count) < 0) {
+    return -1;
+  }
+  if(geom->layercnt + src->layercnt > geom->layercap) {
+    size_t cap = geom->layercap ? geom->layercap : 64;
+    while(cap < geom->layercnt + src->layercnt) {
+      cap *= 2;
+    }
+    layer *layers = realloc(geom->layers, cap * sizeof(layer));
+    if(!layers) {
+      return -1;
+    }
+    geom->layers = layers;
+    geom->layercap = cap;
+  }
+  const size_t base = geom->count;
+  memcpy(geom->verts + base * 3, src->verts, src->count * 3 * sizeof(float));
+  memcpy(geom->colors + base * 3, src->colors,
+         src->count * 3 * sizeof(float));
+  geom->count += src->count;
+
+  /* What comes before src's first layer carries on geom's last */
+  const size_t lead = src->layercnt ? src->layers[0].first : src->count;
+  if(geom->layercnt) {
     size_t i;
-    for(i = 0; i < block->wordcnt; ++i) {
-      const gcword word = block->words[i];
-      switch(word.letter) {
-      case 'G':
-        lastg = (int)word.num;
-        switch((int)word.num) {
-        case 0:                 /* Rapid Positioning */
-          if(extruding) {
-            glColor3f(1.0, 0.5, 0.0);
-          } else {
-            glColor3f(0.5, 0.5, 0.5);
-          }
-          break;
-          
-        case 1:                 /* Linear Interpolation */
-          if(extruding) {
-            glColor3f(0.0, 1.0, 0.25);
-          } else {
-            glColor3f(0.5, 0.5, 0.5);
-          }
-          break;
-
-        case 90:                /* Absolute positioning */
-          relative = 0;
-          break;
-        case 91:                /* Relative positioning */
-          relative = 1;
-          break;
-
-        case 2:                 /* CW arc */
-        case 3:                 /* CC arc */
-          fprintf(stderr, "UNIMPLEMENTED: Line %d: G%d\n", block->real_line, (int)word.num);
-          break;
-
-          /* Ignored */
-        case 4:                 /* Dwell */
-        case 20:                /* Inches (TODO: Scale) */
-        case 21:                /* mm */
-        case 28:                /* Home (implemented in axis words) */
-        case 92:                /* Set offset */
-          break;
-
-        default:
-          fprintf(stderr, "WARNING: Line %d: Skipping unrecognized G code G%d\n", block->real_line, (int)word.num);
-          break;
-        }
-        break;
-
-      case 'M':
-        switch((int)word.num) {
-          /* Extruder motor state */
-        case 101:               /* On */
-          extruding = 1;
-          statechange = 1;
-          break;
-        case 102:               /* Off */
-        case 103:               /* Reverse */
-          extruding = 0;
-          statechange = 1;
-          break;
-
-          /* Ignored */
-        case 1:                 /* Interactive extruder test */
-        case 6:                 /* Wait for warmup */
-        case 104:               /* Set temp (slow) (TODO: color?) */
-        case 105:               /* Get temp */
-        case 106:               /* Fan on (color?) */
-        case 107:               /* Fan off (color?) */
-        case 108:               /* Set speed */
-        case 109:               /* Set temp (slow) (color?) */
-        case 113:               /* Extruder PWM */
-          break;
-
-        default:
-          fprintf(stderr, "WARNING: Line %d: Skipping unrecognized M code M%d\n", block->real_line, (unsigned)word.num);
-          break;
-        }
-        break;
-
-      case 'X':
-        switch(lastg) {
-        case 0:
-        case 1:
-          peek.x = (relative ? peek.x : 0) + word.num;
-          moved = 1;
-          break;
-
-        case 28:
-          peek.x = 0;
-          moved = 1;
-          break;
-
-        default:
-          break;
-        }
-        break;
-
-      case 'Y':
-        switch(lastg) {
-        case 0:
-        case 1:
-          peek.y = (relative ? peek.y : 0) + word.num;
-          moved = 1;
-          break;
-
-        case 28:
-          peek.y = 0;
-          moved = 1;
-          break;
-
-        default:
-          break;
-        }
-        break;
-
-      case 'Z':
-        switch(lastg) {
-        case 0:
-        case 1:
-          peek.z = (relative ? peek.z : 0) + word.num;
-          moved = 1;
-          break;
-
-        case 28:
-          peek.z = 0;
-          moved = 1;
-          break;
-
-        default:
-          break;
+    for(i = 0; i < lead; ++i) {
+      bound(&geom->layers[geom->layercnt - 1].box, src->verts + i * 3);
+    }
+  }
+  size_t i;
+  for(i = 0; i < src->layercnt; ++i) {
+    layer *l = &geom->layers[geom->layercnt++];
+    *l = src->layers[i];
+    l->first += base;
+  }
+  return 0;
+}
+
+void geometry_layers(const geometry *geom, size_t lo, size_t hi,
+                     size_t *first, size_t *count) {
+  if(!geom->layercnt) {
+    *first = 0;
+    *count = geom->count;
+    return;
+  }
+  if(hi >= geom->layercnt) {
+    hi = geom->layercnt - 1;
+  }
+  if(lo > hi) {
+    lo = hi;
+  }
+  /* A layer's first segment starts from the vertex before its first */
+  const size_t start = (lo && geom->layers[lo].first)
+    ? geom->layers[lo].first - 1 : 0;
+  const size_t end = hi + 1 < geom->layercnt
+    ? geom->layers[hi + 1].first - 1 : geom->count - 1;
+  *first = start;
+  *count = end + 1 - start;
+}
+
+int geometry_bounds(const geometry *geom, bounds *box) {
+  if(!geom->count) {
+    return -1;
+  }
+  enclose(box, geom->verts);
+  size_t v;
+  for(v = 1; v < geom->count; ++v) {
+    bound(box, geom->verts + v * 3);
+  }
+  return 0;
+}
+
+/* Takes vertex v into the boxes of runs of per vertices, the vertex
+ * starting each run also ending the last */
+static void extend(bounds *boxes, size_t per, size_t v, const float *p) {
+  const size_t i = v / per;
+  if(v % per) {
+    bound(&boxes[i], p);
+    return;
+  }
+  if(i) {
+    bound(&boxes[i - 1], p);
+  }
+  enclose(&boxes[i], p);
+}
+
+int geometry_chunk(geometry *geom) {
+  if(geom->chunked == geom->count) {
+    return 0;
+  }
+  /* Room for the chunk the last vertex starts, even if it's empty */
+  const size_t n = (geom->count - 1) / CHUNK_VERTS + 1;
+  if(n > geom->chunkcap) {
+    size_t cap = geom->chunkcap ? geom->chunkcap : CHUNK_GROUP;
+    while(cap < n) {
+      cap *= 2;
+    }
+    bounds *chunks = realloc(geom->chunks, cap * sizeof(bounds));
+    if(!chunks) {
+      return -1;
+    }
+    geom->chunks = chunks;
+    bounds *groups = realloc(geom->groups,
+                             cap / CHUNK_GROUP * sizeof(bounds));
+    if(!groups) {
+      return -1;
+    }
+    geom->groups = groups;
+    geom->chunkcap = cap;
+  }
+  size_t v;
+  for(v = geom->chunked; v < geom->count; ++v) {
+    const float *p = geom->verts + v * 3;
+    extend(geom->chunks, CHUNK_VERTS, v, p);
+    extend(geom->groups, CHUNK_VERTS * CHUNK_GROUP, v, p);
+  }
+  geom->chunked = geom->count;
+  return 0;
+}
+
+void frustum_planes(frustum planes, const float *projection,
+                    const float *modelview) {
+  float m[16];
+  int r, c, k;
+  for(c = 0; c < 4; ++c) {
+    for(r = 0; r < 4; ++r) {
+      m[c * 4 + r] = 0;
+      for(k = 0; k < 4; ++k) {
+        m[c * 4 + r] += projection[k * 4 + r] * modelview[c * 4 + k];
+      }
+    }
+  }
+  /* Clip space puts what's seen at -w <= x, y, z <= w; each plane is
+   * the last row of the matrix plus or minus another */
+  int i;
+  for(i = 0; i < 3; ++i) {
+    for(c = 0; c < 4; ++c) {
+      planes[2 * i][c] = m[c * 4 + 3] + m[c * 4 + i];
+      planes[2 * i + 1][c] = m[c * 4 + 3] - m[c * 4 + i];
+    }
+  }
+}
+
+#define OUTSIDE 0
+#define INSIDE 1
+#define ACROSS 2
+
+/* Whether a box is wholly outside the planes, wholly inside them, or
+ * across any */
+static int classify(const frustum planes, const bounds *b) {
+  int i, j, result = INSIDE;
+  for(i = 0; i < 6; ++i) {
+    const float *p = planes[i];
+    /* The corners furthest inside and furthest outside */
+    float in = p[3], out = p[3];
+    for(j = 0; j < 3; ++j) {
+      in += p[j] * (p[j] >= 0 ? b->max[j] : b->min[j]);
+      out += p[j] * (p[j] >= 0 ? b->min[j] : b->max[j]);
+    }
+    if(in < 0) {
+      return OUTSIDE;
+    }
+    if(out < 0) {
+      result = ACROSS;
+    }
+  }
+  return result;
+}
+
+/* Adds vertices start to end as a strip, or to the last strip if it
+ * ends at start */
+static void addstrip(size_t start, size_t end, int *firsts, int *counts,
+                     size_t *strips) {
+  if(*strips && (size_t)(firsts[*strips - 1] + counts[*strips - 1]) == start + 1) {
+    counts[*strips - 1] += end - start;
+  } else {
+    firsts[*strips] = start;
+    counts[*strips] = end - start + 1;
+    ++*strips;
+  }
+}
+
+size_t geometry_visible(const geometry *geom, const frustum planes,
+                        size_t first, size_t count, int *firsts, int *counts) {
+  if(count < 2) {
+    return 0;
+  }
+  const size_t last = first + count - 1;
+  const size_t per = CHUNK_VERTS * CHUNK_GROUP;
+  size_t strips = 0, g, c;
+  /* Each group, then chunk, that has a segment ending from first + 1
+   * to last */
+  for(g = first / per; g * per < last; ++g) {
+    const int seen = classify(planes, &geom->groups[g]);
+    if(seen == OUTSIDE) {
+      continue;
+    }
+    if(seen == INSIDE) {
+      addstrip(g * per > first ? g * per : first,
+               (g + 1) * per < last ? (g + 1) * per : last,
+               firsts, counts, &strips);
+      continue;
+    }
+    const size_t lo = g * per > first ? g * CHUNK_GROUP : first / CHUNK_VERTS;
+    for(c = lo; c < (g + 1) * CHUNK_GROUP && c * CHUNK_VERTS < last; ++c) {
+      if(classify(planes, &geom->chunks[c]) == OUTSIDE) {
+        continue;
+      }
+      addstrip(c * CHUNK_VERTS > first ? c * CHUNK_VERTS : first,
+               (c + 1) * CHUNK_VERTS < last ? (c + 1) * CHUNK_VERTS : last,
+               firsts, counts, &strips);
+    }
+  }
+  return strips;
+}
+
+/* Squared distance from p to the segment from a to b */
+static float segdist2(const float *p, const float *a, const float *b) {
+  const float ab[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+  const float ap[3] = {p[0] - a[0], p[1] - a[1], p[2] - a[2]};
+  const float len2 = ab[0] * ab[0] + ab[1] * ab[1] + ab[2] * ab[2];
+  float t = 0;
+  if(len2 > 0) {
+    t = (ap[0] * ab[0] + ap[1] * ab[1] + ap[2] * ab[2]) / len2;
+    t = t < 0 ? 0 : (t > 1 ? 1 : t);
+  }
+  const float d[3] = {ap[0] - t * ab[0], ap[1] - t * ab[1], ap[2] - t * ab[2]};
+  return d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+}
+
+void simplifier_init(simplifier *simp, float tolerance) {
+  simp->tolerance = tolerance;
+  simp->runlen = 0;
+  simp->started = 0;
+}
+
+/* Keeps the vertex held back, starting the next run from it */
+static void keep(simplifier *simp, geometry *dst) {
+  const float *last = simp->run[simp->runlen - 1];
+  push(dst, last, simp->color);
+  memcpy(simp->anchor, last, sizeof(simp->anchor));
+  simp->runlen = 0;
+}
+
+/* Simplifies src's vertices from start on */
+static int simplify_from(simplifier *simp, const geometry *src, size_t start,
+                         geometry *dst) {
+  /* At most a vertex per vertex given, and one held back before */
+  if(reserve(dst, dst->count + (src->count - start) + 1) < 0) {
+    return -1;
+  }
+  const float tol2 = simp->tolerance * simp->tolerance;
+  size_t i, next = src->layercnt;
+  while(next && src->layers[next - 1].first >= start) {
+    --next;
+  }
+  for(i = start; i < src->count; ++i) {
+    const float *v = src->verts + i * 3;
+    const float *c = src->colors + i * 3;
+    if(next < src->layercnt && src->layers[next].first == i) {
+      /* Keeps the layer's first segment whole */
+      if(simp->runlen) {
+        keep(simp, dst);
+      }
+      push(dst, v, c);
+      memcpy(simp->anchor, v, sizeof(simp->anchor));
+      simp->started = 1;
+      if(addlayer(dst, src->layers[next].z) < 0) {
+        return -1;
+      }
+      ++next;
+      continue;
+    }
+    if(!simp->started) {
+      push(dst, v, c);
+      memcpy(simp->anchor, v, sizeof(simp->anchor));
+      simp->started = 1;
+      continue;
+    }
+    /* Merging across a change of color would recolor what's merged */
+    char merge = simp->runlen > 0 && simp->runlen < SIMPLIFY_RUN
+      && !memcmp(c, simp->color, sizeof(simp->color));
+    size_t j;
+    for(j = 0; merge && j < simp->runlen; ++j) {
+      merge = segdist2(simp->run[j], simp->anchor, v) <= tol2;
+    }
+    if(!merge && simp->runlen) {
+      keep(simp, dst);
+    }
+    memcpy(simp->run[simp->runlen++], v, 3 * sizeof(float));
+    memcpy(simp->color, c, sizeof(simp->color));
+  }
+  return 0;
+}
+
+int simplify(simplifier *simp, const geometry *src, geometry *dst) {
+  return simplify_from(simp, src, 0, dst);
+}
+
+int simplify_finish(simplifier *simp, geometry *dst) {
+  if(!simp->runlen) {
+    return 0;
+  }
+  if(reserve(dst, dst->count + 1) < 0) {
+    return -1;
+  }
+  keep(simp, dst);
+  return 0;
+}
+
+void simplifier_init_lods(simplifier *simps, float tolerance) {
+  /* Coarser levels merge what's already been merged, so their errors
+   * add up; scaled like this, the sum for each comes to what it should
+   * be alone */
+  float scale = 1;
+  int lod;
+  simplifier_init(&simps[0], tolerance);
+  for(lod = 1; lod < LODS; ++lod) {
+    scale *= LOD_SCALE;
+    simplifier_init(&simps[lod],
+                    tolerance * scale * (LOD_SCALE - 1) / LOD_SCALE);
+  }
+}
+
+int simplify_lods(simplifier *simps, const geometry *src, geometry *dsts,
+                  char finish) {
+  const geometry *from = src;
+  size_t start = 0;
+  int lod;
+  for(lod = 0; lod < LODS; ++lod) {
+    const size_t first = dsts[lod].count;
+    if(simplify_from(&simps[lod], from, start, &dsts[lod]) < 0
+       || (finish && simplify_finish(&simps[lod], &dsts[lod]) < 0)) {
+      return -1;
+    }
+    /* The next level takes just what this one added */
+    from = &dsts[lod];
+    start = first;
+  }
+  return 0;
+}
+
+void toolpath_init(toolpath *path, const gcprogram *prog) {
+  gcinterp_init(&path->interp, prog, 0);
+  setcolor(path->color, 0.5, 0.5, 0.5);
+  path->started = 0;
+  path->e = 0;
+  path->layerz = 0;
+  path->layered = 0;
+}
+
+void toolpath_free(toolpath *path) {
+  gcinterp_free(&path->interp);
+}
+
+long toolpath_update(toolpath *path, geometry *geom) {
+  const size_t first = geom->count;
+  const gcstate *state = &path->interp.state;
+  /* At most a vertex per new block, and the origin */
+  if(reserve(geom, first + 1
+             + (path->interp.prog->blockcnt - path->interp.block)) < 0) {
+    return -1;
+  }
+  if(!path->started) {
+    pushpoint(geom, state->pos, path->color);
+    path->started = 1;
+  }
+
+  /* Evaluate blocks sequentially */
+  int flags;
+  while((flags = gcinterp_step(&path->interp)) >= 0) {
+    if(flags & GCSTEP_MOTION) {
+      if(state->extruding) {
+        if(state->lastg == 0) {
+          setcolor(path->color, 1.0, 0.5, 0.0);
+        } else {
+          setcolor(path->color, 0.0, 1.0, 0.25);
         }
-        break;
-
-        /* Ignored words */
-      case 'F':                 /* Feedrate */
-      case 'P':                 /* Param to Dwell, others? */
-      case 'S':                 /* Speed (TODO: consider coloring) */
-      case 'R':                 /* Param to M108 meaning what? */
-      case 'T':                 /* Param to M6 (wait for warmup), others? */
-      case 'E':                 /* Extrude length */
-        break;
-
-      default:
-        fprintf(stderr, "WARNING: Line %d: Skipping unrecognized word %c\n", block->real_line, word.letter);
-        break;
+      } else {
+        setcolor(path->color, 0.5, 0.5, 0.5);
       }
     }
-    /* Contiguous line simplification; interferes with coloring */
-    /* const point nextdelta = {next.x - peek.x, next.y - peek.y, next.z - peek.z}; */
-    /* const point currdelta = {curr.x - next.x, curr.y - next.y, curr.z - next.z}; */
-    /* const float dtheta = angle(currdelta, nextdelta); */
-    if(moved) {
-      glVertex3f(next.x, next.y, next.z);
-      curr = next;
+    if(flags & GCSTEP_MOVED) {
+      pushpoint(geom, state->pos, path->color);
+      /* Either kind of extruder control counts as printing */
+      const char prints = state->extruding || state->e > path->e;
+      if(prints && (!path->layered
+                    || fabsf(state->pos.z - path->layerz) >= LAYER_MIN)) {
+        if(addlayer(geom, state->pos.z) < 0) {
+          return -1;
+        }
+        path->layerz = state->pos.z;
+        path->layered = 1;
+      }
     }
-    next = peek;
+    path->e = state->e;
   }
-  glVertex3f(peek.x, peek.y, peek.z);
-  glEnd();
+  return first;
 }
@@ -1,3 +1,152 @@
+#ifndef _RENDER_H_
+#define _RENDER_H_
+
+#include <stddef.h>
+
 #include "../common/gcode.h"
+#include "../common/interp.h"
+
+/* Smallest change in Z taken to start a new layer, in mm */
+#define LAYER_MIN 0.02f
+
+/* An axis-aligned box */
+typedef struct bounds {
+  float min[3], max[3];
+} bounds;
+
+/* A layer begins with the first segment that prints at a new height,
+ * and runs up to the next, taking in any travel moves between. */
+typedef struct layer {
+  size_t first;                 /* Vertex that first segment ends at */
+  float z;
+  bounds box;                   /* Of its vertices */
+} layer;
+
+/* Vertices per chunk.  Chunk i holds the segments ending at vertices
+ * i*CHUNK_VERTS+1 to (i+1)*CHUNK_VERTS, the toolpath's own order keeping
+ * each one close together. */
+#define CHUNK_VERTS 256
+/* Chunks per group, bounded in turn so that culling can pass over or
+ * take whole groups without looking at their chunks */
+#define CHUNK_GROUP 64
+
+/* Vertices of a line strip, with a color per vertex that colors the
+ * segment ending there, and where its layers begin.  Vertices before
+ * the first layer belong to the last layer of whatever geometry this
+ * follows, if any. */
+typedef struct geometry {
+  float *verts;                 /* x, y, z per vertex */
+  float *colors;                /* r, g, b per vertex */
+  size_t count, cap;
+  layer *layers;
+  size_t layercnt, layercap;
+  bounds *chunks;               /* Of each chunk's segments */
+  bounds *groups;               /* Of each group's chunks */
+  size_t chunked, chunkcap;     /* Vertices taken into chunks */
+} geometry;
+
+void geometry_init(geometry *geom);
+
+void geometry_free(geometry *geom);
+
+/* Forgets all vertices and layers, keeping the memory for them. */
+void geometry_clear(geometry *geom);
+
+/* Appends src's vertices and layers to geom.  Returns -1 if memory ran
+ * out. */
+int geometry_append(geometry *geom, const geometry *src);
+
+/* Finds the vertices to draw as a line strip to show layers lo through
+ * hi, the first of them from where its first segment starts.  A lo of 0
+ * includes whatever precedes the first layer. */
+void geometry_layers(const geometry *geom, size_t lo, size_t hi,
+                     size_t *first, size_t *count);
+
+/* Finds the bounds of all of geom's vertices.  Returns -1 if it has
+ * none. */
+int geometry_bounds(const geometry *geom, bounds *box);
+
+/* Brings the chunks' bounds up to date with the vertices added since
+ * last time.  Returns -1 if memory ran out. */
+int geometry_chunk(geometry *geom);
+
+/* Six planes, each a, b, c, d, with ax + by + cz + d >= 0 inside */
+typedef float frustum[6][4];
+
+/* Finds the planes bounding what's seen through the column-major
+ * projection and modelview matrices. */
+void frustum_planes(frustum planes, const float *projection,
+                    const float *modelview);
+
+/* Splits the vertices first to first + count - 1 into line strips,
+ * leaving out the chunks wholly outside planes and running together
+ * those that aren't.  firsts and counts need room for a strip per
+ * chunk.  Returns the number of strips. */
+size_t geometry_visible(const geometry *geom, const frustum planes,
+                        size_t first, size_t count, int *firsts, int *counts);
+
+/* Levels of detail, each merging segments with LOD_SCALE times the
+ * tolerance of the last */
+#define LODS 4
+#define LOD_SCALE 4
+/* Most vertices merged into one segment, bounding the cost per vertex */
+#define SIMPLIFY_RUN 32
+
+/* Merges runs of nearly collinear segments of the same color, as
+ * vertices are given to it, so that no vertex dropped is further than
+ * tolerance from the segment drawn in its place. */
+typedef struct simplifier {
+  float tolerance;
+  float anchor[3];              /* The last vertex kept */
+  float run[SIMPLIFY_RUN][3];   /* Vertices since, the last held back */
+  float color[3];               /* Of the run */
+  size_t runlen;
+  char started;
+} simplifier;
+
+void simplifier_init(simplifier *simp, float tolerance);
+
+/* Appends to dst a simplification of src's vertices, carrying on from
+ * those given before.  The last vertex may be held back until it's
+ * known whether the next replaces it.  The vertices either side of the
+ * segment beginning each layer are always kept, so that dst has the
+ * same layers.  Returns -1 if memory ran out. */
+int simplify(simplifier *simp, const geometry *src, geometry *dst);
+
+/* Appends any vertex held back.  Returns -1 if memory ran out. */
+int simplify_finish(simplifier *simp, geometry *dst);
+
+/* Sets up a simplifier for each level of detail, so that the finest
+ * merges with tolerance and each coarser one with LOD_SCALE times the
+ * tolerance of the last. */
+void simplifier_init_lods(simplifier *simps, float tolerance);
+
+/* Simplifies src into each of dsts, one per level of detail, each level
+ * merging what's new in the one finer than it.  If finish is set,
+ * nothing is held back.  Returns -1 if memory ran out. */
+int simplify_lods(simplifier *simps, const geometry *src, geometry *dsts,
+                  char finish);
+
+/* Turns a program into geometry as blocks are added to it, carrying on
+ * from wherever the last update left off, so a program streamed in a
+ * line at a time costs the same per line however long it gets. */
+typedef struct toolpath {
+  gcinterp interp;              /* Next block to add */
+  float color[3];               /* For the next segment */
+  char started;                 /* The origin's been added */
+  float e;                      /* Extruder position before the block */
+  float layerz;                 /* Of the last layer begun */
+  char layered;                 /* Any layer's been begun */
+} toolpath;
+
+void toolpath_init(toolpath *path, const gcprogram *prog);
+
+void toolpath_free(toolpath *path);
+
+/* Appends to geom the path of the blocks added to the program since the
+ * last update, starting at the origin, and marks where layers begin.
+ * Returns the index in geom of the first new vertex, or -1 if memory
+ * ran out. */
+long toolpath_update(toolpath *path, geometry *geom);
 
-void render_words(gcblock *head);
+#endif
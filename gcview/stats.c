@@ -0,0 +1,107 @@
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "stats.h"
+
+#define STATS_CSV_HEADER "frame,ms,events_ms,idle_ms,update_ms,draw_ms," \
+  "read_ms,parse_ms,build_ms,bytes,blocks,vertices,drawn,lod,rss\n"
+
+uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+size_t stats_rss(void) {
+#ifdef LINUX
+  /* Pages in all, then pages resident */
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if(!statm) {
+    return 0;
+  }
+  unsigned long size, resident;
+  const int found = fscanf(statm, "%lu %lu", &size, &resident);
+  fclose(statm);
+  if(found != 2) {
+    return 0;
+  }
+  return (size_t)resident * sysconf(_SC_PAGESIZE);
+#else
+  return 0;
+#endif
+}
+
+int stats_open(stats *s, const char *path) {
+  memset(s, 0, sizeof(stats));
+  if(!path) {
+    return 0;
+  }
+  s->trace = fopen(path, "w");
+  if(!s->trace) {
+    return -1;
+  }
+  const size_t len = strlen(path);
+  s->json = len >= 5 && !strcmp(path + len - 5, ".json");
+  fputs(s->json ? "[\n" : STATS_CSV_HEADER, s->trace);
+  return 0;
+}
+
+static double ms(uint64_t ns) {
+  return ns / 1e6;
+}
+
+void stats_frame(stats *s, framestats *f) {
+  if(!s->count) {
+    s->epoch = f->start;
+  }
+  f->frame = s->count;
+  f->start -= s->epoch;
+  s->frames[s->count++ % STATS_FRAMES] = *f;
+  if(!s->trace) {
+    return;
+  }
+  if(s->json) {
+    fprintf(s->trace, "%s{\"frame\": %lu, \"ms\": %.3f, \"events_ms\": %.3f, "
+            "\"idle_ms\": %.3f, \"update_ms\": %.3f, \"draw_ms\": %.3f, "
+            "\"read_ms\": %.3f, \"parse_ms\": %.3f, \"build_ms\": %.3f, "
+            "\"bytes\": %llu, \"blocks\": %llu, \"vertices\": %zu, "
+            "\"drawn\": %zu, \"lod\": %d, \"rss\": %zu}",
+            f->frame ? ",\n" : "", f->frame, ms(f->start),
+            ms(f->stage[STAGE_EVENTS]), ms(f->stage[STAGE_IDLE]),
+            ms(f->stage[STAGE_UPDATE]), ms(f->stage[STAGE_DRAW]),
+            ms(f->reader[READER_READ]), ms(f->reader[READER_PARSE]),
+            ms(f->reader[READER_BUILD]),
+            (unsigned long long)f->bytes, (unsigned long long)f->blocks,
+            f->vertices, f->drawn, f->lod, f->rss);
+  } else {
+    fprintf(s->trace, "%lu,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,"
+            "%llu,%llu,%zu,%zu,%d,%zu\n",
+            f->frame, ms(f->start),
+            ms(f->stage[STAGE_EVENTS]), ms(f->stage[STAGE_IDLE]),
+            ms(f->stage[STAGE_UPDATE]), ms(f->stage[STAGE_DRAW]),
+            ms(f->reader[READER_READ]), ms(f->reader[READER_PARSE]),
+            ms(f->reader[READER_BUILD]),
+            (unsigned long long)f->bytes, (unsigned long long)f->blocks,
+            f->vertices, f->drawn, f->lod, f->rss);
+  }
+}
+
+const framestats *stats_get(const stats *s, unsigned long back) {
+  if(back >= s->count || back >= STATS_FRAMES) {
+    return NULL;
+  }
+  return &s->frames[(s->count - 1 - back) % STATS_FRAMES];
+}
+
+void stats_close(stats *s) {
+  if(!s->trace) {
+    return;
+  }
+  if(s->json) {
+    fputs(s->count ? "\n]\n" : "]\n", s->trace);
+  }
+  fclose(s->trace);
+  s->trace = NULL;
+}
@@ -0,0 +1,71 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Frames kept for the overlay */
+#define STATS_FRAMES 128
+
+/* Stages of the main loop, in the order they run */
+enum {
+  STAGE_EVENTS,                 /* Handling input */
+  STAGE_IDLE,                   /* Waiting out the rest of the frame */
+  STAGE_UPDATE,                 /* Taking in and uploading new geometry */
+  STAGE_DRAW,                   /* Drawing and swapping buffers */
+  STAGES
+};
+
+/* Stages of the reader thread, timed in total since the last frame */
+enum {
+  READER_READ,                  /* Waiting on input */
+  READER_PARSE,
+  READER_BUILD,                 /* Turning blocks into geometry */
+  READER_STAGES
+};
+
+/* What one frame took */
+typedef struct framestats {
+  unsigned long frame;
+  uint64_t start;               /* ns since the first frame */
+  uint64_t stage[STAGES];       /* ns in each */
+  uint64_t reader[READER_STAGES];
+  uint64_t bytes, blocks;       /* Read and parsed so far */
+  size_t vertices;              /* At the finest level of detail */
+  size_t drawn;                 /* At the level drawn */
+  int lod;
+  size_t rss;                   /* Bytes resident */
+} framestats;
+
+typedef struct stats {
+  framestats frames[STATS_FRAMES]; /* The last few, by frame number */
+  unsigned long count;
+  uint64_t epoch;               /* When the first frame started */
+  FILE *trace;                  /* Set if every frame's written out */
+  char json;                    /* Otherwise CSV */
+} stats;
+
+/* Monotonic time in ns */
+uint64_t stats_now(void);
+
+/* Bytes of memory resident, or 0 if that can't be found. */
+size_t stats_rss(void);
+
+/* Starts keeping statistics, written to a trace at path unless it's
+ * NULL: JSON if path ends in .json, otherwise CSV.  Returns -1 with
+ * errno set if the trace can't be opened. */
+int stats_open(stats *s, const char *path);
+
+/* Records a frame, its number and start made relative to the first's,
+ * and writes it to the trace. */
+void stats_frame(stats *s, framestats *f);
+
+/* The frame back frames before the last recorded, or NULL if there's
+ * none. */
+const framestats *stats_get(const stats *s, unsigned long back);
+
+/* Finishes and closes any trace. */
+void stats_close(stats *s);
+
+#endif
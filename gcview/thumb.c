@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "../common/gcode.h"
+#include "../common/gcmap.h"
+#include "../common/parallel.h"
+#include "../common/gcbin.h"
+#include "../common/stream.h"
+#include "../common/decompress.h"
+#include "../common/diag.h"
+#include "../common/png.h"
+#include "render.h"
+#include "raster.h"
+#include "thumb.h"
+
+#define DEFAULT_W 320
+#define DEFAULT_H 240
+#define FOV 45.0f               /* Vertical, in degrees, as gcview's */
+
+/* Camera presets */
+static const struct {
+  const char *name;
+  float latitude, spin;         /* See raster_camera */
+} views[] = {
+  {"iso", 55, 30},
+  {"top", 0, 0},
+  {"front", 90, 0},
+  {"side", 90, 90},
+};
+#define VIEWS (sizeof(views) / sizeof(views[0]))
+
+/* A file to draw */
+typedef struct job {
+  const char *input;            /* NULL for the standard input */
+  char *output;
+} job;
+
+/* Files shared out between the workers */
+typedef struct pool {
+  const thumbopts *opts;
+  job *jobs;
+  size_t count;
+  size_t next;                  /* Next job to take, atomically */
+  size_t failed;                /* Likewise */
+  unsigned parsers;             /* Threads to parse each file on */
+} pool;
+
+void thumb_defaults(thumbopts *opts) {
+  opts->output = NULL;
+  opts->view = 0;
+  opts->width = DEFAULT_W;
+  opts->height = DEFAULT_H;
+  opts->threads = 0;
+}
+
+int thumb_option(thumbopts *opts, int opt, const char *arg) {
+  switch(opt) {
+  case 'o':
+    opts->output = arg;
+    return 1;
+
+  case 'c': {
+    size_t v;
+    for(v = 0; v < VIEWS && strcmp(arg, views[v].name); ++v);
+    if(v == VIEWS) {
+      fprintf(stderr, "Unknown view \"%s\"; try iso, top, front or side\n", arg);
+      exit(EXIT_FAILURE);
+    }
+    opts->view = v;
+    return 1;
+  }
+
+  case 'g':
+    if(sscanf(arg, "%ux%u", &opts->width, &opts->height) != 2
+       || !opts->width || !opts->height) {
+      fprintf(stderr, "Size must be given as WxH, e.g. %ux%u\n",
+              DEFAULT_W, DEFAULT_H);
+      exit(EXIT_FAILURE);
+    }
+    return 1;
+
+  case 'j':
+    opts->threads = strtoul(arg, NULL, 10);
+    return 1;
+
+  default:
+    return 0;
+  }
+}
+
+/* Reads gcode from fd into prog, compiled, compressed or neither,
+ * parsing it on up to threads threads.  Returns -1 with a message
+ * printed on failure. */
+static int load(const char *name, int fd, gcprogram *prog, gcdiag *diag,
+                unsigned threads) {
+  char peek[GCDECOMPRESS_PEEK];
+  size_t peeklen;
+  fd = gcdecompress_open(fd, peek, &peeklen);
+  if(fd < 0) {
+    fprintf(stderr, "%s: %s\n", name, strerror(errno));
+    return -1;
+  }
+  gcparse parse;
+  gcparse_init(&parse, prog);
+  parse.diag = diag;
+  int result = gcbin_load(&parse, fd);
+  if(result == 0) {
+    close(fd);
+    return 0;
+  } else if(result != GCBIN_NOT_BINARY) {
+    fprintf(stderr, "%s: %s\n", name, gcbin_strerror(result));
+    close(fd);
+    return -1;
+  }
+
+  gcmap map;
+  if(gcmap_open(&map, fd) == 0) {
+    result = gcparse_parallel(&parse, map.data, map.len, threads);
+    if(result < 0) {
+      fprintf(stderr, "%s: %s\n", name, strerror(errno));
+    }
+    gcmap_close(&map);
+    close(fd);
+    return result;
+  }
+
+  gcstream stream;
+  gcstream_init(&stream, &parse);
+  result = gcstream_push(&stream, peek, peeklen) < 0 ? -1 : 0;
+  char buf[GCODE_BLOCKSIZE*64];
+  ssize_t bytes;
+  while(result == 0 && (bytes = read(fd, buf, sizeof(buf))) != 0) {
+    if(bytes < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      result = -1;
+    } else if(gcstream_push(&stream, buf, bytes) < 0) {
+      result = -1;
+    }
+  }
+  if(result < 0) {
+    fprintf(stderr, "%s: %s\n", name, strerror(errno));
+  }
+  /* Decompressing may have stopped short, which looks like EOF */
+  if(gcdecompress_close(fd) < 0 && result == 0) {
+    fprintf(stderr, "%s: %s\n", name, strerror(errno));
+    result = -1;
+  }
+  gcstream_finish(&stream);
+  gcstream_free(&stream);
+  return result;
+}
+
+/* Draws a file's toolpath into r and writes it out.  Returns -1 with a
+ * message printed on failure. */
+static int draw(const thumbopts *opts, const job *j, unsigned threads,
+                raster *r) {
+  const char *name = j->input ? j->input : "stdin";
+  const int fd = j->input ? open(j->input, O_RDONLY) : dup(STDIN_FILENO);
+  if(fd < 0) {
+    fprintf(stderr, "%s: %s\n", name, strerror(errno));
+    return -1;
+  }
+  gcprogram prog;
+  gcdiag diag;
+  gcprogram_init(&prog);
+  gcdiag_init(&diag);
+  int result = load(name, fd, &prog, &diag, threads);
+  if(gcdiag_count(&diag)) {
+    /* Keeps each file's warnings together */
+    flockfile(stderr);
+    fprintf(stderr, "%s:\n", name);
+    gcdiag_report(&diag, stderr);
+    funlockfile(stderr);
+  }
+
+  toolpath path;
+  geometry geom;
+  toolpath_init(&path, &prog);
+  geometry_init(&geom);
+  if(result == 0 && toolpath_update(&path, &geom) < 0) {
+    fprintf(stderr, "%s: Out of memory for geometry!\n", name);
+    result = -1;
+  }
+  if(result == 0) {
+    raster_clear(r);
+    bounds box;
+    if(geometry_bounds(&geom, &box) == 0) {
+      float mvp[16];
+      raster_camera(mvp, &box, views[opts->view].latitude,
+                    views[opts->view].spin, FOV,
+                    (float)r->width / r->height);
+      raster_strip(r, &geom, mvp);
+    }
+    if(gcpng_write(j->output, r->rgb, r->width, r->height) < 0) {
+      fprintf(stderr, "%s: %s\n", j->output, strerror(errno));
+      result = -1;
+    }
+  }
+  geometry_free(&geom);
+  toolpath_free(&path);
+  gcdiag_free(&diag);
+  gcprogram_free(&prog);
+  return result;
+}
+
+/* A worker thread: draws files until there are none left */
+static void *work(void *data) {
+  pool *p = data;
+  raster r;
+  if(raster_init(&r, p->opts->width, p->opts->height) < 0) {
+    fprintf(stderr, "Out of memory for a %ux%u image!\n",
+            p->opts->width, p->opts->height);
+    exit(EXIT_FAILURE);
+  }
+  size_t i;
+  while((i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->count) {
+    if(draw(p->opts, &p->jobs[i], p->parsers, &r) < 0) {
+      __atomic_fetch_add(&p->failed, 1, __ATOMIC_RELAXED);
+    }
+  }
+  raster_free(&r);
+  return NULL;
+}
+
+/* Adds a job for every regular file in dir, besides hidden ones, to
+ * draw into a PNG of the same name in outdir.  Returns the number of
+ * jobs, or exits on failure. */
+static size_t listdir(const char *dir, const char *outdir, job **jobs) {
+  DIR *d = opendir(dir);
+  if(!d) {
+    perror(dir);
+    exit(EXIT_FAILURE);
+  }
+  size_t count = 0, cap = 0;
+  *jobs = NULL;
+  struct dirent *e;
+  while((e = readdir(d))) {
+    if(e->d_name[0] == '.') {
+      continue;
+    }
+    char *input = malloc(strlen(dir) + strlen(e->d_name) + 2);
+    sprintf(input, "%s/%s", dir, e->d_name);
+    struct stat st;
+    if(stat(input, &st) < 0 || !S_ISREG(st.st_mode)) {
+      free(input);
+      continue;
+    }
+
+    /* foo.gcode.gz draws into foo.png */
+    size_t len = strlen(e->d_name);
+    gcdecompress_suffix(e->d_name, &len);
+    size_t dot = len;
+    while(dot && e->d_name[dot - 1] != '.') {
+      --dot;
+    }
+    if(dot) {
+      len = dot - 1;
+    }
+    char *output = malloc(strlen(outdir) + len + 6);
+    sprintf(output, "%s/%.*s.png", outdir, (int)len, e->d_name);
+
+    if(count == cap) {
+      cap = cap ? 2 * cap : 64;
+      *jobs = realloc(*jobs, cap * sizeof(job));
+      if(!*jobs) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    (*jobs)[count].input = input;
+    (*jobs)[count].output = output;
+    ++count;
+  }
+  closedir(d);
+  return count;
+}
+
+int thumb_run(const thumbopts *opts, const char *input) {
+  pool p;
+  p.opts = opts;
+  p.next = 0;
+  p.failed = 0;
+
+  struct stat st;
+  if(input && stat(input, &st) == 0 && S_ISDIR(st.st_mode)) {
+    if(mkdir(opts->output, 0777) < 0 && errno != EEXIST) {
+      perror(opts->output);
+      return EXIT_FAILURE;
+    }
+    p.count = listdir(input, opts->output, &p.jobs);
+  } else {
+    p.jobs = malloc(sizeof(job));
+    p.jobs[0].input = input;
+    p.jobs[0].output = strdup(opts->output);
+    p.count = 1;
+  }
+
+  unsigned threads = opts->threads;
+  if(!threads) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? cpus : 1;
+  }
+  if(threads > p.count) {
+    threads = p.count ? p.count : 1;
+  }
+  /* A file at a time can be parsed on every CPU instead */
+  p.parsers = threads == 1 ? opts->threads : 1;
+
+  pthread_t *workers = malloc(threads * sizeof(pthread_t));
+  unsigned started;
+  for(started = 1; started < threads; ++started) {
+    if(pthread_create(&workers[started], NULL, &work, &p) != 0) {
+      break;
+    }
+  }
+  /* We work too, so that it gets done even if no thread started */
+  work(&p);
+  unsigned i;
+  for(i = 1; i < started; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+
+  for(i = 0; i < p.count; ++i) {
+    if(p.jobs[i].input != input) {
+      free((char*)p.jobs[i].input);
+    }
+    free(p.jobs[i].output);
+  }
+  free(p.jobs);
+  if(p.failed) {
+    fprintf(stderr, "%zu of %zu files could not be drawn\n", p.failed, p.count);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+#ifdef HEADLESS
+/* Built without SDL or OpenGL, all gcview can do is draw thumbnails */
+#define HELP "Usage: gcview -o png [-c view] [-g WxH] [-j n] [file]\n" \
+  "Built without SDL or OpenGL, so only able to draw thumbnails.\n" \
+  THUMB_HELP \
+  "\tfile\tFile or directory to read from, either gcode or compiled by gccompile.  Standard input is used if this is omitted.\n"
+
+int main(int argc, char **argv) {
+  thumbopts opts;
+  thumb_defaults(&opts);
+  int opt;
+  while((opt = getopt(argc, argv, "h?" THUMB_OPTS)) >= 0) {
+    if(!thumb_option(&opts, opt, optarg)) {
+      printf("%s", HELP);
+      exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+  if(!opts.output) {
+    fprintf(stderr, "%s", HELP);
+    exit(EXIT_FAILURE);
+  }
+  return thumb_run(&opts, optind < argc ? argv[optind] : NULL);
+}
+#endif
@@ -0,0 +1,31 @@
+#ifndef _THUMB_H_
+#define _THUMB_H_
+
+/* getopt letters for thumbnails, shared by gcview and its headless
+ * build */
+#define THUMB_OPTS "o:c:g:j:"
+
+#define THUMB_HELP \
+  "\t-o png\tDraw the whole toolpath into a PNG on the CPU, with no window, and exit.  If file is a directory, png is a directory to draw each file in it into, named after it.\n" \
+  "\t-c view\tWhere to look from with -o: iso (default), top, front or side\n" \
+  "\t-g WxH\tSize of the PNGs (default 320x240)\n" \
+  "\t-j n\tFiles to draw at once with -o (default one per CPU)\n"
+
+typedef struct thumbopts {
+  const char *output;           /* Set if thumbnails were asked for */
+  int view;                     /* Which camera preset */
+  unsigned width, height;
+  unsigned threads;             /* 0 for one per CPU */
+} thumbopts;
+
+void thumb_defaults(thumbopts *opts);
+
+/* Takes an option from THUMB_OPTS, exiting if its argument is bad.
+ * Returns 0 if opt isn't one. */
+int thumb_option(thumbopts *opts, int opt, const char *arg);
+
+/* Draws thumbnails of input, a file or a directory of them, or of the
+ * standard input if it's NULL.  Returns an exit status. */
+int thumb_run(const thumbopts *opts, const char *input);
+
+#endif